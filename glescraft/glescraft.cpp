@@ -1,10 +1,34 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <map>
+#include <chrono>
+#include <memory>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #include <GL/glew.h>
 #include <GL/glut.h>
+#ifdef FREEGLUT
+#include <GL/freeglut_ext.h>
+#endif
 
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
@@ -18,9 +42,15 @@
 
 static GLuint program;
 static GLint attribute_coord;
+static GLint attribute_offset;
 static GLint uniform_mvp;
+static GLint uniform_compact;
+static GLint uniform_meshed;
 static GLuint texture;
 static GLint uniform_texture;
+static GLint uniform_cutoff;
+static GLint uniform_holecenter;
+static GLint uniform_holeradius;
 static GLuint cursor_vbo;
 
 static glm::vec3 position;
@@ -35,27 +65,82 @@ static int mx, my, mz;
 static int face;
 static uint8_t buildtype = 1;
 
-static time_t now;
 static unsigned int keys;
 static bool select_using_depthbuffer = false;
+static int seed;
+static bool greedy_meshing = true;
+static bool bitmask_faces = true;
+static bool simd_noise = true;
+static bool arena_mode = false;
+static bool occlusion_culling = true;
+static bool indexed_quads = true;
+static bool compact_vertices = true;
+static bool skip_empty_space = true;
+static bool lod_meshing = true;
+static bool draw_horizon = true;
+static int lod_distance = 96;
+static int upload_budget = 32;
+static int view_radius = 0;
+// Directory the world is saved in, or none to not save it. Set with --world.
+static const char *worlddir = 0;
+
+// Size of one chunk in blocks. The chunk, superchunk and the code working on their blocks are templates with
+// parameters of the same names, these are the sizes used by the game itself.
+static const int CX = 16;
+static const int CY = 32;
+static const int CZ = 16;
+
+// Number of chunks kept around the camera at most. The grid is wide enough for the default view radius to reach
+// into the coarsest level of detail.
+static const int SCX = 64;
+static const int SCY = 2;
+static const int SCZ = 64;
+
+// Chunk meshes are split into this many sections stacked along the y axis. Each section can be meshed and
+// uploaded on its own, so changing a block only remeshes the section it is in.
+static const int SECTIONS = 4;
+static const int ALLSECTIONS = (1 << SECTIONS) - 1;
+
+// Faces of water and glass are blended over everything else, so they are kept apart. The buffer of a chunk holds
+// the opaque faces of all sections first, followed by the water and glass faces of all sections.
+static const int MESHSECTIONS = 2 * SECTIONS;
+
+// Distant chunks are meshed with less detail, at level k merging cubes of 2^k by 2^k by 2^k blocks into one.
+// Level 1 starts at lod_distance blocks from the camera, and every next level at twice the distance of the one before.
+static const int LODLEVELS = 4;
+
+// Level of detail ring that distance d from the camera falls in
+static int lodring(float d) {
+	int level = 0;
+	while(level < LODLEVELS - 1 && d >= lod_distance << level)
+		level++;
+	return level;
+}
 
-// Size of one chunk in blocks
-#define CX 16
-#define CY 32
-#define CZ 16
+// Largest of the chunk dimensions
+#define MAXDIM (CX > CY ? (CX > CZ ? CX : CZ) : (CY > CZ ? CY : CZ))
 
-// Number of chunks in the world
-#define SCX 32
-#define SCY 2
-#define SCZ 32
+// Worst case number of quads in a chunk mesh: every face of every block is visible, and none can be merged.
+// That happens for example with alternating leaves and glass, which don't hide each other.
+#define MAXQUADS (CX * CY * CZ * 6)
 
 // Sea level
 #define SEALEVEL 4
 
-// Number of VBO slots for chunks
-#define CHUNKSLOTS (SCX * SCY * SCZ)
-
 static const int transparent[16] = {2, 0, 0, 0, 1, 0, 0, 0, 3, 4, 0, 0, 0, 0, 0, 0}; 
+// Light given off by every block type. White blocks are used as lamps.
+static const int emission[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 14, 0, 0};
+
+// Water and glass are see-through, and drawn blended over everything else
+static bool blended(uint8_t b) {
+	return transparent[b] >= 3;
+}
+
+// Sky light goes straight down through air and glass without getting weaker
+static bool skythrough(uint8_t b) {
+	return !b || transparent[b] == 4;
+}
+
 static const char *blocknames[16] = {
 	"air", "dirt", "topsoil", "grass", "leaves", "wood", "stone", "sand",
 	"water", "glass", "brick", "ore", "woodrings", "white", "black", "x-y"
@@ -63,61 +148,307 @@ static const char *blocknames[16] = {
 
 typedef glm::tvec4<GLbyte, glm::mediump> byte4;
 
-static struct chunk *chunk_slot[CHUNKSLOTS] = {0};
+// The six directions a face can look at
+enum {
+	FACE_NX, FACE_PX, FACE_NY, FACE_PY, FACE_NZ, FACE_PZ
+};
 
-struct chunk {
-	uint8_t blk[CX][CY][CZ];
-	struct chunk *left, *right, *below, *above, *front, *back;
-	int slot;
-	GLuint vbo;
-	int elements;
-	time_t lastused;
-	bool changed;
-	bool noised;
-	bool initialized;
-	int ax;
-	int ay;
-	int az;
+// For each face direction, the axis it is perpendicular to (d), the two axes spanning the face (u, v),
+// the normal vector, and the order in which the corners of a quad are emitted as two triangles.
+static const struct facedir {
+	int d, u, v;
+	int n[3];
+	int corner[6][2];
+} facedirs[6] = {
+	{0, 1, 2, {-1, 0, 0}, {{0, 0}, {0, 1}, {1, 0}, {1, 0}, {0, 1}, {1, 1}}},
+	{0, 1, 2, {+1, 0, 0}, {{0, 0}, {1, 0}, {0, 1}, {1, 0}, {1, 1}, {0, 1}}},
+	{1, 0, 2, {0, -1, 0}, {{0, 0}, {1, 0}, {0, 1}, {1, 0}, {1, 1}, {0, 1}}},
+	{1, 0, 2, {0, +1, 0}, {{0, 0}, {0, 1}, {1, 0}, {1, 0}, {0, 1}, {1, 1}}},
+	{2, 0, 1, {0, 0, -1}, {{0, 0}, {0, 1}, {1, 0}, {1, 0}, {0, 1}, {1, 1}}},
+	{2, 0, 1, {0, 0, +1}, {{0, 0}, {1, 0}, {0, 1}, {1, 0}, {1, 1}, {0, 1}}},
+};
 
-	chunk(): ax(0), ay(0), az(0) {
-		memset(blk, 0, sizeof blk);
-		left = right = below = above = front = back = 0;
-		lastused = now;
-		slot = 0;
-		changed = true;
-		initialized = false;
-		noised = false;
+// Formats of chunk meshes. Quads are either two triangles of three vertices each, or only their four corners,
+// drawn using the shared quad index buffer. Compact vertices are byte4 as well, but as unsigned bytes with the
+// face in the top two bits of y and z, which the vertex shader uses to orient the texture and shade the face,
+// so they do not need the top bit of the texture that marks top and bottom faces in plain vertices.
+// Both have the ambient occlusion in the top two bits of x.
+enum {
+	MESH_INDEXED = 1,
+	MESH_COMPACT = 2,
+};
+
+// Texture index of the face of block type b that is facing in direction f
+static int facetexture(uint8_t b, int f) {
+	uint8_t top = b;
+	uint8_t bottom = b;
+	uint8_t side = b;
+
+	// Grass block has dirt sides and bottom
+	if(top == 3) {
+		bottom = 1;
+		side = 2;
+	// Wood blocks have rings on top and bottom
+	} else if(top == 5) {
+		top = bottom = 12;
 	}
 
-	chunk(int x, int y, int z): ax(x), ay(y), az(z) {
-		memset(blk, 0, sizeof blk);
-		left = right = below = above = front = back = 0;
-		lastused = now;
-		slot = 0;
-		changed = true;
-		initialized = false;
-		noised = false;
+	if(f == FACE_NY)
+		return bottom + 128;
+	if(f == FACE_PY)
+		return top + 128;
+	return side;
+}
+
+// Add a quad of size h along the u axis and w along the v axis, with its lowest corner at (x, y, z).
+// The low byte of info is the texture, the next byte the ambient occlusion of the four corners, two bits each,
+// for the corner at the low or high end of the u axis in bit 0 and of the v axis in bit 1 of the corner number.
+static int emitquad(byte4 *vertex, int i, int f, int x, int y, int z, int h, int w, int info, int format) {
+	const struct facedir &fd = facedirs[f];
+	int p[3] = {x, y, z};
+	int tex = info & 255;
+	int ao = info >> 8;
+
+	// Faces looking in the positive direction lie on the far side of the block
+	if(fd.n[fd.d] > 0)
+		p[fd.d]++;
+
+	// Both triangles share the diagonal between the second and third corner, so for indexed
+	// quads only the corner opposite the first one has to be added
+	int n = format & MESH_INDEXED ? 4 : 6;
+
+	// The corners in the order they are emitted. The first one is always (0, 0), and the fourth is (1, 1).
+	int corner[6][2];
+	for(int k = 0; k < 6; k++) {
+		corner[k][0] = n == 4 && k == 3 ? 1 : fd.corner[k][0];
+		corner[k][1] = n == 4 && k == 3 ? 1 : fd.corner[k][1];
+	}
+
+	// Occlusion is interpolated differently depending on which diagonal the triangles share. Take the diagonal
+	// through the least occluded pair of corners, so the same occlusion looks the same whichever way it is facing.
+	if((ao & 3) + (ao >> 6 & 3) < (ao >> 2 & 3) + (ao >> 4 & 3)) {
+		static const int flipped[6] = {1, 3, 0, 0, 3, 2};
+		int quad[4][2] = {{0, 0}, {corner[1][0], corner[1][1]}, {corner[2][0], corner[2][1]}, {1, 1}};
+
+		for(int k = 0; k < n; k++) {
+			int j = flipped[n == 4 && k == 3 ? 5 : k];
+			corner[k][0] = quad[j][0];
+			corner[k][1] = quad[j][1];
+		}
+	}
+
+	for(int k = 0; k < n; k++) {
+		int c[3] = {p[0], p[1], p[2]};
+		c[fd.u] += corner[k][0] * h;
+		c[fd.v] += corner[k][1] * w;
+
+		int occlusion = (ao >> 2 * (corner[k][0] | corner[k][1] << 1) & 3) << 6;
+
+		if(format & MESH_COMPACT)
+			vertex[i++] = byte4(c[0] | occlusion, c[1] | (f & 3) << 6, c[2] | (f >> 2) << 6, tex & 127);
+		else
+			vertex[i++] = byte4(c[0] | occlusion, c[1], c[2], tex);
+	}
+
+	return i;
+}
+
+// The ambient occlusion of the four corners of a face, as found by meshjob::faceocclusion(), for every combination
+// of opaque blocks in the layer in front of it. Bit (du + 1) * 3 + dv + 1 of the index is set if the block at
+// offset du along the u axis and dv along the v axis from the block in front of the face is opaque.
+static const struct occlusiontable {
+	uint8_t ao[512];
+
+	occlusiontable() {
+		for(int around = 0; around < 512; around++) {
+			ao[around] = 0;
+
+			for(int k = 0; k < 4; k++) {
+				int du = k & 1 ? 2 : 0;
+				int dv = k & 2 ? 2 : 0;
+				bool side1 = around >> (du * 3 + 1) & 1;
+				bool side2 = around >> (3 + dv) & 1;
+				bool diagonal = around >> (du * 3 + dv) & 1;
+
+				ao[around] |= (side1 && side2 ? 3 : side1 + side2 + diagonal) << 2 * k;
+			}
+		}
+	}
+} aotable;
+
+// A job is run on one of the worker threads, and afterwards finished on the main thread.
+// Only the main thread is allowed to make OpenGL calls or to touch the chunks themselves.
+// Jobs with a lower priority value are run first.
+struct job {
+	float priority;
+
+	job(float priority = 0): priority(priority) {}
+	virtual ~job() {}
+	virtual void run() = 0;
+	// Returns the number of meshes uploaded to the GPU, which count against the upload budget
+	virtual int finish() = 0;
+
+	static bool later(const job *a, const job *b) {
+		return a->priority > b->priority;
+	}
+};
+
+struct workqueue {
+	std::vector<std::thread> workers;
+	std::vector<job *> todo;
+	std::deque<job *> done;
+	std::mutex lock;
+	std::condition_variable wakeup;
+	int running;
+	bool quit;
+
+	workqueue(): running(0), quit(false) {}
+
+	~workqueue() {
+		stop();
+	}
+
+	void start(int n) {
+		quit = false;
+		for(int i = 0; i < n; i++)
+			workers.push_back(std::thread(&workqueue::work, this));
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			quit = true;
+		}
+		wakeup.notify_all();
+
+		for(size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+		workers.clear();
+
+		for(size_t i = 0; i < todo.size(); i++)
+			delete todo[i];
+		todo.clear();
+		while(!done.empty()) {
+			delete done.front();
+			done.pop_front();
+		}
+	}
+
+	void push(job *j) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			todo.push_back(j);
+			std::push_heap(todo.begin(), todo.end(), job::later);
+		}
+		wakeup.notify_one();
 	}
 
+	void work() {
+		std::unique_lock<std::mutex> guard(lock);
+
+		while(true) {
+			while(!quit && todo.empty())
+				wakeup.wait(guard);
+			if(quit)
+				return;
+
+			std::pop_heap(todo.begin(), todo.end(), job::later);
+			job *j = todo.back();
+			todo.pop_back();
+			running++;
+
+			guard.unlock();
+			j->run();
+			guard.lock();
+
+			running--;
+			done.push_back(j);
+		}
+	}
+
+	// Finish jobs that the workers have completed, until max meshes have been uploaded.
+	void finish(int max) {
+		int n = 0;
+
+		while(n < max) {
+			job *j;
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				if(done.empty())
+					break;
+				j = done.front();
+				done.pop_front();
+			}
+			n += j->finish();
+			delete j;
+		}
+	}
+
+	size_t queued() {
+		std::lock_guard<std::mutex> guard(lock);
+		return todo.size() + done.size();
+	}
+
+	// Run and finish all jobs, including the ones that finishing others adds, so nothing refers to the chunks anymore
+	void drain() {
+		while(true) {
+			finish(INT_MAX);
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				if(todo.empty() && done.empty() && !running)
+					return;
+			}
+			std::this_thread::yield();
+		}
+	}
+};
+
+static workqueue jobqueue;
+
+// Where a section of a chunk mesh is in the buffer of the chunk, in vertices. Every section is followed
+// by degenerate vertices up to its room, so it can grow a bit without moving the other sections.
+// Sections SECTIONS and up have the water and glass faces of the sections below SECTIONS.
+struct meshsection {
+	int first;
+	int count;
+	int room;
+	int quads;
+	int merged;
+};
+
+// Builds the vertices for a chunk on a worker thread. It works on a copy of the blocks of the chunk,
+// including a one block wide border taken from its neighbours, so the chunk can be changed in the meantime.
+template<int CX, int CY, int CZ> struct basicchunk;
+
+template<int CX, int CY, int CZ> struct meshjob: job {
+	typedef basicchunk<CX, CY, CZ> chunk;
+
+	chunk *c;
+	uint8_t blk[CX + 2][CY + 2][CZ + 2];
+	uint8_t light[CX + 2][CY + 2][CZ + 2];
+	std::vector<byte4> vertices;
+	int quads;
+	int merged;
+	bool greedy;
+	bool bitmask;
+	int format;
+	int lod;
+	uint8_t connects[6];
+
+	// Sections of the mesh to make. If patch is set, only their vertices are replaced in the buffer of the chunk.
+	int sections;
+	bool patch;
+	meshsection section[MESHSECTIONS];
+
+	meshjob(chunk *c, int sections = ALLSECTIONS);
+
 	uint8_t get(int x, int y, int z) const {
-		if(x < 0)
-			return left ? left->blk[x + CX][y][z] : 0;
-		if(x >= CX)
-			return right ? right->blk[x - CX][y][z] : 0;
-		if(y < 0)
-			return below ? below->blk[x][y + CY][z] : 0;
-		if(y >= CY)
-			return above ? above->blk[x][y - CY][z] : 0;
-		if(z < 0)
-			return front ? front->blk[x][y][z + CZ] : 0;
-		if(z >= CZ)
-			return back ? back->blk[x][y][z - CZ] : 0;
-		return blk[x][y][z];
+		return blk[x + 1][y + 1][z + 1];
 	}
 
-	bool isblocked(int x1, int y1, int z1, int x2, int y2, int z2) {
+	bool isblocked(int x1, int y1, int z1, int x2, int y2, int z2) const {
 		// Invisible blocks are always "blocked"
-		if(!blk[x1][y1][z1])
+		if(!get(x1, y1, z1))
 			return true;
 
 		// Leaves do not block any other block, including themselves
@@ -129,569 +460,4067 @@ struct chunk {
 			return true;
 
 		// Otherwise, LOS is only blocked by blocks if the same transparency type
-		return transparent[get(x2, y2, z2)] == transparent[blk[x1][y1][z1]];
+		return transparent[get(x2, y2, z2)] == transparent[get(x1, y1, z1)];
 	}
 
-	void set(int x, int y, int z, uint8_t type) {
-		// If coordinates are outside this chunk, find the right one.
-		if(x < 0) {
-			if(left)
-				left->set(x + CX, y, z, type);
-			return;
-		}
-		if(x >= CX) {
-			if(right)
-				right->set(x - CX, y, z, type);
-			return;
-		}
-		if(y < 0) {
-			if(below)
-				below->set(x, y + CY, z, type);
-			return;
-		}
-		if(y >= CY) {
-			if(above)
-				above->set(x, y - CY, z, type);
-			return;
-		}
-		if(z < 0) {
-			if(front)
-				front->set(x, y, z + CZ, type);
-			return;
+	// Everything emitquad() needs to know about face f of block (x, y, z): the texture, with the light level in
+	// bits 4 to 6, which are not used by texture numbers, and the ambient occlusion of its corners above that.
+	// Bit 16 is set for faces that are blended. Only faces that are the same in all of it can be merged.
+	// If the bitmasks of the columns made by visiblefaces() are given, the occlusion is found from those.
+	int faceinfo(int x, int y, int z, int f, const uint64_t (*column)[CZ + 2][5] = 0) const {
+		uint8_t b = get(x, y, z);
+		int ao = lod ? 0 : column ? faceocclusion(column, x, y, z, f) : faceocclusion(x, y, z, f);
+		return facetexture(b, f) | facelight(x, y, z, f) << 4 | ao << 8 | blended(b) << 16;
+	}
+
+	// Ambient occlusion of the four corners of face f of block (x, y, z), from 0 for none to 3 for a corner
+	// with opaque blocks on both sides. It is found from the blocks around the corner, in the layer in front of the face.
+	int faceocclusion(int x, int y, int z, int f) const {
+		const struct facedir &fd = facedirs[f];
+		int q[3] = {x + fd.n[0], y + fd.n[1], z + fd.n[2]};
+		int ao = 0;
+
+		for(int k = 0; k < 4; k++) {
+			int a[3] = {q[0], q[1], q[2]};
+			int b[3] = {q[0], q[1], q[2]};
+			a[fd.u] += k & 1 ? 1 : -1;
+			b[fd.v] += k & 2 ? 1 : -1;
+
+			bool side1 = !transparent[get(a[0], a[1], a[2])];
+			bool side2 = !transparent[get(b[0], b[1], b[2])];
+			a[fd.v] = b[fd.v];
+			bool diagonal = !transparent[get(a[0], a[1], a[2])];
+
+			ao |= (side1 && side2 ? 3 : side1 + side2 + diagonal) << 2 * k;
 		}
-		if(z >= CZ) {
-			if(back)
-				back->set(x, y, z - CZ, type);
-			return;
+
+		return ao;
+	}
+
+	// The same, from the bitmasks of opaque blocks of the columns. The nine blocks in the layer in front of the
+	// face are gathered into an index for aotable, from as few columns as possible.
+	int faceocclusion(const uint64_t (*column)[CZ + 2][5], int x, int y, int z, int f) const {
+		// Bits 0 to 2 of a column moved to bits 0, 3 and 6, the same offset along the v axis
+		static const int spread[8] = {0, 1, 8, 9, 64, 65, 72, 73};
+		const struct facedir &fd = facedirs[f];
+		int q[3] = {x + fd.n[0] + 1, y + fd.n[1] + 1, z + fd.n[2] + 1};
+		int around = 0;
+
+		if(fd.d == 0) {
+			// The u axis is y, so every column has three of the blocks, one for each offset along z
+			for(int dv = 0; dv < 3; dv++)
+				around |= spread[column[q[0]][q[2] + dv - 1][0] >> (q[1] - 1) & 7] << dv;
+		} else if(fd.d == 2) {
+			// The v axis is y, so every column has three of the blocks, one for each offset along x
+			for(int du = 0; du < 3; du++)
+				around |= (column[q[0] + du - 1][q[2]][0] >> (q[1] - 1) & 7) << du * 3;
+		} else {
+			// The layer is across the columns, so each one has one of the blocks
+			for(int du = 0; du < 3; du++)
+				for(int dv = 0; dv < 3; dv++)
+					around |= (column[q[0] + du - 1][q[2] + dv - 1][0] >> q[1] & 1) << (du * 3 + dv);
 		}
 
-		// Change the block
-		blk[x][y][z] = type;
-		changed = true;
+		return aotable.ao[around];
+	}
 
-		// When updating blocks at the edge of this chunk,
-		// visibility of blocks in the neighbouring chunk might change.
-		if(x == 0 && left)
-			left->changed = true;
-		if(x == CX - 1 && right)
-			right->changed = true;
-		if(y == 0 && below)
-			below->changed = true;
-		if(y == CY - 1 && above)
-			above->changed = true;
-		if(z == 0 && front)
-			front->changed = true;
-		if(z == CZ - 1 && back)
-			back->changed = true;
+	// Light level from 0 to 7 of face f of block (x, y, z), which is the light of the block in front of it
+	int facelight(int x, int y, int z, int f) const {
+		const struct facedir &fd = facedirs[f];
+		uint8_t l = light[x + fd.n[0] + 1][y + fd.n[1] + 1][z + fd.n[2] + 1];
+		return std::max(l >> 4, l & 15) >> 1;
 	}
 
-	static float noise2d(float x, float y, int seed, int octaves, float persistence) {
-		float sum = 0;
-		float strength = 1.0;
-		float scale = 1.0;
+	void coarsen();
+	void skirts();
+	void visiblefaces();
+	void slicefaces(int f, int s, int y0, int y1, int *mask) const;
+	void meshrange(int y0, int y1, byte4 *vertex[2], meshsection *part[2]);
+	void connectivity();
+	void run();
+	int finish();
+};
 
-		for(int i = 0; i < octaves; i++) {
-			sum += strength * glm::simplex(glm::vec2(x, y) * scale);
-			scale *= 2.0;
-			strength *= persistence;
-		}
+// Integer hash of a position and a seed, used for random decisions that must not depend
+// on the order in which chunks are generated.
+static uint32_t poshash(int x, int y, int z, int seed) {
+	uint32_t h = (uint32_t)x * 0x8da6b343u ^ (uint32_t)y * 0xd8163841u ^ (uint32_t)z * 0xcb1ab31fu;
+	h ^= (uint32_t)seed * 0x9e3779b9u;
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h;
+}
 
-		return sum;
+// Lane types for the batched noise kernels below. Each holds a number of floats (N)
+// that are processed in lock step, and supports the few operations simplex noise needs.
+// The scalar one is used for the leftovers at the end of a batch.
+
+struct simd1 {
+	enum { N = 1 };
+	float v;
+
+	simd1() {}
+	simd1(float v): v(v) {}
+	static simd1 load(const float *p) { return *p; }
+	void store(float *p) const { *p = v; }
+
+	friend simd1 operator+(simd1 a, simd1 b) { return a.v + b.v; }
+	friend simd1 operator-(simd1 a, simd1 b) { return a.v - b.v; }
+	friend simd1 operator*(simd1 a, simd1 b) { return a.v * b.v; }
+	friend simd1 vfloor(simd1 a) { return floorf(a.v); }
+	friend simd1 vabs(simd1 a) { return fabsf(a.v); }
+	friend simd1 vmin(simd1 a, simd1 b) { return a.v < b.v ? a.v : b.v; }
+	friend simd1 vmax(simd1 a, simd1 b) { return a.v > b.v ? a.v : b.v; }
+	// Like GLSL step(): 0 if x < edge, 1 otherwise
+	friend simd1 vstep(simd1 edge, simd1 x) { return x.v < edge.v ? 0.0f : 1.0f; }
+};
+
+#ifdef __SSE2__
+struct simd4 {
+	enum { N = 4 };
+	__m128 v;
+
+	simd4() {}
+	simd4(__m128 v): v(v) {}
+	simd4(float f): v(_mm_set1_ps(f)) {}
+	static simd4 load(const float *p) { return _mm_loadu_ps(p); }
+	void store(float *p) const { _mm_storeu_ps(p, v); }
+
+	friend simd4 operator+(simd4 a, simd4 b) { return _mm_add_ps(a.v, b.v); }
+	friend simd4 operator-(simd4 a, simd4 b) { return _mm_sub_ps(a.v, b.v); }
+	friend simd4 operator*(simd4 a, simd4 b) { return _mm_mul_ps(a.v, b.v); }
+	friend simd4 vfloor(simd4 a) {
+#ifdef __SSE4_1__
+		return _mm_floor_ps(a.v);
+#else
+		// Truncate, then correct negative non-integer values
+		__m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+		return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a.v), _mm_set1_ps(1.0f)));
+#endif
 	}
+	friend simd4 vabs(simd4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+	friend simd4 vmin(simd4 a, simd4 b) { return _mm_min_ps(a.v, b.v); }
+	friend simd4 vmax(simd4 a, simd4 b) { return _mm_max_ps(a.v, b.v); }
+	friend simd4 vstep(simd4 edge, simd4 x) { return _mm_and_ps(_mm_cmpge_ps(x.v, edge.v), _mm_set1_ps(1.0f)); }
+};
+#endif
+
+#ifdef __AVX__
+struct simd8 {
+	enum { N = 8 };
+	__m256 v;
+
+	simd8() {}
+	simd8(__m256 v): v(v) {}
+	simd8(float f): v(_mm256_set1_ps(f)) {}
+	static simd8 load(const float *p) { return _mm256_loadu_ps(p); }
+	void store(float *p) const { _mm256_storeu_ps(p, v); }
+
+	friend simd8 operator+(simd8 a, simd8 b) { return _mm256_add_ps(a.v, b.v); }
+	friend simd8 operator-(simd8 a, simd8 b) { return _mm256_sub_ps(a.v, b.v); }
+	friend simd8 operator*(simd8 a, simd8 b) { return _mm256_mul_ps(a.v, b.v); }
+	friend simd8 vfloor(simd8 a) { return _mm256_floor_ps(a.v); }
+	friend simd8 vabs(simd8 a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+	friend simd8 vmin(simd8 a, simd8 b) { return _mm256_min_ps(a.v, b.v); }
+	friend simd8 vmax(simd8 a, simd8 b) { return _mm256_max_ps(a.v, b.v); }
+	friend simd8 vstep(simd8 edge, simd8 x) { return _mm256_and_ps(_mm256_cmp_ps(x.v, edge.v, _CMP_GE_OQ), _mm256_set1_ps(1.0f)); }
+};
+#endif
 
-	static float noise3d_abs(float x, float y, float z, int seed, int octaves, float persistence) {
-		float sum = 0;
-		float strength = 1.0;
-		float scale = 1.0;
+// The same simplex noise functions as glm::simplex(), written out so they work on any of the lane types.
 
-		for(int i = 0; i < octaves; i++) {
-			sum += strength * fabs(glm::simplex(glm::vec3(x, y, z) * scale));
-			scale *= 2.0;
-			strength *= persistence;
-		}
+template<typename V> static inline V mod289(V x) {
+	return x - vfloor(x * (1.0f / 289.0f)) * 289.0f;
+}
 
-		return sum;
+template<typename V> static inline V permute(V x) {
+	return mod289((x * 34.0f + 1.0f) * x);
+}
+
+// Contribution of one corner of a 2D simplex, with hash p, at offset (x, y) from the sample point
+template<typename V> static inline V simplex2corner(V p, V x, V y) {
+	V m = vmax(0.5f - (x * x + y * y), 0.0f);
+	m = m * m;
+	m = m * m;
+
+	V gx = p * 0.024390243902439f;
+	gx = (gx - vfloor(gx)) * 2.0f - 1.0f;
+	V h = vabs(gx) - 0.5f;
+	V a0 = gx - vfloor(gx + 0.5f);
+	m = m * (1.79284291400159f - 0.85373472095314f * (a0 * a0 + h * h));
+
+	return m * (a0 * x + h * y);
+}
+
+template<typename V> static V simplex2(V vx, V vy) {
+	const float C0 = 0.211324865405187f;
+	const float C1 = 0.366025403784439f;
+	const float C2 = -0.577350269189626f;
+
+	// Find the simplex we are in, and the offsets to its three corners
+	V s = (vx + vy) * C1;
+	V ix = vfloor(vx + s);
+	V iy = vfloor(vy + s);
+	V t = (ix + iy) * C0;
+	V x0 = vx - ix + t;
+	V y0 = vy - iy + t;
+	V i1x = 1.0f - vstep(x0, y0);
+	V i1y = 1.0f - i1x;
+	V x1 = x0 - i1x + C0;
+	V y1 = y0 - i1y + C0;
+	V x2 = x0 + C2;
+	V y2 = y0 + C2;
+
+	ix = mod289(ix);
+	iy = mod289(iy);
+	V p0 = permute(permute(iy) + ix);
+	V p1 = permute(permute(iy + i1y) + ix + i1x);
+	V p2 = permute(permute(iy + 1.0f) + ix + 1.0f);
+
+	return (simplex2corner(p0, x0, y0) + simplex2corner(p1, x1, y1) + simplex2corner(p2, x2, y2)) * 130.0f;
+}
+
+// Contribution of one corner of a 3D simplex, with hash p, at offset (x, y, z) from the sample point
+template<typename V> static inline V simplex3corner(V p, V x, V y, V z) {
+	const float n = 0.142857142857f;
+	const float nsx = n * 2.0f;
+	const float nsy = n * 0.5f - 1.0f;
+	const float nsz = n;
+
+	// Map the hash to a gradient on an octahedron
+	V j = p - 49.0f * vfloor(p * nsz * nsz);
+	V gx = vfloor(j * nsz);
+	V gy = vfloor(j - 7.0f * gx);
+	gx = gx * nsx + nsy;
+	gy = gy * nsx + nsy;
+	V gz = 1.0f - vabs(gx) - vabs(gy);
+	V sh = vstep(gz, 0.0f);
+	gx = gx - (vfloor(gx) * 2.0f + 1.0f) * sh;
+	gy = gy - (vfloor(gy) * 2.0f + 1.0f) * sh;
+	V norm = 1.79284291400159f - 0.85373472095314f * (gx * gx + gy * gy + gz * gz);
+
+	V m = vmax(0.6f - (x * x + y * y + z * z), 0.0f);
+	m = m * m;
+
+	return m * m * norm * (gx * x + gy * y + gz * z);
+}
+
+template<typename V> static V simplex3(V vx, V vy, V vz) {
+	const float C0 = 1.0f / 6.0f;
+	const float C1 = 1.0f / 3.0f;
+
+	// Find the simplex we are in, and the offsets to its four corners
+	V s = (vx + vy + vz) * C1;
+	V ix = vfloor(vx + s);
+	V iy = vfloor(vy + s);
+	V iz = vfloor(vz + s);
+	V t = (ix + iy + iz) * C0;
+	V x0 = vx - ix + t;
+	V y0 = vy - iy + t;
+	V z0 = vz - iz + t;
+
+	V gx = vstep(y0, x0);
+	V gy = vstep(z0, y0);
+	V gz = vstep(x0, z0);
+	V lx = 1.0f - gx;
+	V ly = 1.0f - gy;
+	V lz = 1.0f - gz;
+	V i1x = vmin(gx, lz);
+	V i1y = vmin(gy, lx);
+	V i1z = vmin(gz, ly);
+	V i2x = vmax(gx, lz);
+	V i2y = vmax(gy, lx);
+	V i2z = vmax(gz, ly);
+
+	V x1 = x0 - i1x + C0;
+	V y1 = y0 - i1y + C0;
+	V z1 = z0 - i1z + C0;
+	V x2 = x0 - i2x + C1;
+	V y2 = y0 - i2y + C1;
+	V z2 = z0 - i2z + C1;
+	V x3 = x0 - 0.5f;
+	V y3 = y0 - 0.5f;
+	V z3 = z0 - 0.5f;
+
+	ix = mod289(ix);
+	iy = mod289(iy);
+	iz = mod289(iz);
+	V p0 = permute(permute(permute(iz) + iy) + ix);
+	V p1 = permute(permute(permute(iz + i1z) + iy + i1y) + ix + i1x);
+	V p2 = permute(permute(permute(iz + i2z) + iy + i2y) + ix + i2x);
+	V p3 = permute(permute(permute(iz + 1.0f) + iy + 1.0f) + ix + 1.0f);
+
+	return (simplex3corner(p0, x0, y0, z0) + simplex3corner(p1, x1, y1, z1) + simplex3corner(p2, x2, y2, z2) + simplex3corner(p3, x3, y3, z3)) * 42.0f;
+}
+
+// The state of a chunk that does not depend on its size
+struct chunkbase {
+	int slot;
+	int arenaoffset;
+	int arenasize;
+	int elements;
+	int format;
+	int quads;
+	int merged;
+	uint8_t connects[6];
+	meshsection section[MESHSECTIONS];
+	int stale;
+	bool changed;
+	bool meshing;
+	bool noised;
+	bool generating;
+	bool initialized;
+	bool lit;
+	bool lighting;
+	bool dead;
+	bool dirty;
+	float distance;
+	int lod;
+	int ax;
+	int ay;
+	int az;
+
+	chunkbase(int x, int y, int z): ax(x), ay(y), az(z) {
+		slot = -1;
+		arenaoffset = -1;
+		arenasize = 0;
+		elements = quads = merged = 0;
+		format = 0;
+		// Until it is meshed, assume every face can see every other face
+		memset(connects, 0x3f, sizeof connects);
+		memset(section, 0, sizeof section);
+		stale = 0;
+		changed = true;
+		meshing = false;
+		initialized = false;
+		lit = false;
+		lighting = false;
+		noised = false;
+		generating = false;
+		dead = false;
+		dirty = false;
+		distance = 0;
+		lod = 0;
 	}
+};
 
-	void noise(int seed) {
-		if(noised)
+// Hands out VBO slots to chunks. Free slots are kept on a stack, and used slots on a list
+// ordered from least to most recently drawn, so that allocating, evicting and marking
+// a slot as used are all O(1).
+struct slotmanager {
+	std::vector<chunkbase *> owner;
+	std::vector<GLuint> vbo;
+	std::vector<int> prev;
+	std::vector<int> next;
+	int lru;
+	int mru;
+	std::vector<int> freeslots;
+	int nfree;
+	int used;
+	int peak;
+	long allocations;
+	long evictions;
+
+	slotmanager() {
+		nfree = 0;
+		lru = mru = -1;
+		used = peak = 0;
+		allocations = evictions = 0;
+	}
+
+	// Make sure there are at least n slots, enough for every chunk of a world
+	void reserve(int n) {
+		int old = owner.size();
+		if(n <= old)
 			return;
+
+		owner.resize(n, 0);
+		vbo.resize(n, 0);
+		prev.resize(n);
+		next.resize(n);
+		freeslots.resize(n);
+
+		for(int i = n - 1; i >= old; i--)
+			freeslots[nfree++] = i;
+	}
+
+	void unlink(int i) {
+		if(prev[i] >= 0)
+			next[prev[i]] = next[i];
 		else
-			noised = true;
+			lru = next[i];
 
-		for(int x = 0; x < CX; x++) {
-			for(int z = 0; z < CZ; z++) {
-				// Land height
-				float n = noise2d((x + ax * CX) / 256.0, (z + az * CZ) / 256.0, seed, 5, 0.8) * 4;
-				int h = n * 2;
-				int y = 0;
-
-				// Land blocks
-				for(y = 0; y < CY; y++) {
-					// Are we above "ground" level?
-					if(y + ay * CY >= h) {
-						// If we are not yet up to sea level, fill with water blocks
-						if(y + ay * CY < SEALEVEL) {
-							blk[x][y][z] = 8;
-							continue;
-						// Otherwise, we are in the air
-						} else {
-							// A tree!
-							if(get(x, y - 1, z) == 3 && (rand() & 0xff) == 0) {
-								// Trunk
-								h = (rand() & 0x3) + 3;
-								for(int i = 0; i < h; i++)
-									set(x, y + i, z, 5);
-
-								// Leaves
-								for(int ix = -3; ix <= 3; ix++) { 
-									for(int iy = -3; iy <= 3; iy++) { 
-										for(int iz = -3; iz <= 3; iz++) { 
-											if(ix * ix + iy * iy + iz * iz < 8 + (rand() & 1) && !get(x + ix, y + h + iy, z + iz))
-												set(x + ix, y + h + iy, z + iz, 4);
-										}
-									}
-								}
-							}
-							break;
-						}
-					}
+		if(next[i] >= 0)
+			prev[next[i]] = prev[i];
+		else
+			mru = prev[i];
+	}
 
-					// Random value used to determine land type
-					float r = noise3d_abs((x + ax * CX) / 16.0, (y + ay * CY) / 16.0, (z + az * CZ) / 16.0, -seed, 2, 1);
-
-					// Sand layer
-					if(n + r * 5 < 4)
-						blk[x][y][z] = 7;
-					// Dirt layer, but use grass blocks for the top
-					else if(n + r * 5 < 8)
-						blk[x][y][z] = (h < SEALEVEL || y + ay * CY < h - 1) ? 1 : 3;
-					// Rock layer
-					else if(r < 1.25)
-						blk[x][y][z] = 6;
-					// Sometimes, ores!
-					else
-						blk[x][y][z] = 11;
-				}
-			}
+	void append(int i) {
+		prev[i] = mru;
+		next[i] = -1;
+
+		if(mru >= 0)
+			next[mru] = i;
+		else
+			lru = i;
+
+		mru = i;
+	}
+
+	// Mark a slot as the most recently used one
+	void touch(int i) {
+		if(i == mru)
+			return;
+
+		unlink(i);
+		append(i);
+	}
+
+	// Give a slot to chunk c, taking it away from the least recently used chunk if there are no free ones left
+	int alloc(chunkbase *c);
+
+	// Give a slot back, for example when its chunk is no longer needed
+	void release(int i) {
+		unlink(i);
+		owner[i] = 0;
+		freeslots[nfree++] = i;
+		used--;
+	}
+};
+
+static slotmanager slots;
+
+// Index buffer shared by all meshes with four vertices per quad, which are drawn as two triangles
+struct quadindexbuffer {
+	GLuint ibo;
+	int quads;
+
+	quadindexbuffer(): ibo(0), quads(0) {}
+
+	// Make sure there are indices for at least n quads
+	void reserve(int n) {
+		if(n <= quads)
+			return;
+
+		int newquads = quads ? quads : 4096;
+		while(newquads < n)
+			newquads *= 2;
+
+		std::vector<GLuint> indices(newquads * 6);
+		for(int q = 0; q < newquads; q++) {
+			indices[q * 6 + 0] = q * 4 + 0;
+			indices[q * 6 + 1] = q * 4 + 1;
+			indices[q * 6 + 2] = q * 4 + 2;
+			indices[q * 6 + 3] = q * 4 + 2;
+			indices[q * 6 + 4] = q * 4 + 1;
+			indices[q * 6 + 5] = q * 4 + 3;
 		}
-		changed = true;
+
+		if(!ibo)
+			glGenBuffers(1, &ibo);
+
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof indices[0], indices.data(), GL_STATIC_DRAW);
+		quads = newquads;
 	}
+};
 
-	void update() {
-		byte4 vertex[CX * CY * CZ * 18];
-		int i = 0;
-		int merged = 0;
-		bool vis = false;;
+static quadindexbuffer quadindices;
 
-		// View from negative x
+// Point the coord attribute at vertices in the given format, in the currently bound buffer
+static void coordpointer(int format) {
+	glUniform1i(uniform_meshed, 1);
+	glUniform1i(uniform_compact, format & MESH_COMPACT ? 1 : 0);
+	glVertexAttribPointer(attribute_coord, 4, format & MESH_COMPACT ? GL_UNSIGNED_BYTE : GL_BYTE, GL_FALSE, 0, 0);
+}
 
-		for(int x = CX - 1; x >= 0; x--) {
-			for(int y = 0; y < CY; y++) {
-				for(int z = 0; z < CZ; z++) {
-					// Line of sight blocked?
-					if(isblocked(x, y, z, x - 1, y, z)) {
-						vis = false;
-						continue;
-					}
+// The positions of the chunks drawn from the vertex arena and of the quads of the horizon are shorts, which cannot
+// hold world coordinates far from the start. They are relative to this origin instead, which follows the camera
+// in steps of ORIGINSTEP blocks. Whenever it moves, the positions stored in the horizon are written again.
+static const int ORIGINSTEP = 8192;
+static int originx;
+static int originz;
+
+// Instead of giving each chunk its own VBO, all chunk meshes can also be sub-allocated from one big arena,
+// so they can all be drawn with a single indirect multi-draw call. Since that leaves no room to change the
+// model matrix per chunk, every draw gets its own instance, and the position of its chunk relative to the origin
+// comes from a small table with one entry per draw, read as an instanced attribute starting at the base instance.
+// Offsets and sizes are in vertices.
+struct vertexarena {
+	// Allocations are rounded up to this many vertices, to limit fragmentation.
+	// The capacity is always a power of two, so it is a multiple of this as well.
+	enum { GRANULE = 256 };
 
-					uint8_t top = blk[x][y][z];
-					uint8_t bottom = blk[x][y][z];
-					uint8_t side = blk[x][y][z];
-
-					// Grass block has dirt sides and bottom
-					if(top == 3) {
-						bottom = 1;
-						side = 2;
-					// Wood blocks have rings on top and bottom
-					} else if(top == 5) {
-						top = bottom = 12;
-					}
+	GLuint vbo;
+	GLuint offsetvbo;
+	GLuint commandvbo;
+	int capacity;
+	int used;
+	long grows;
+	std::map<int, int> freeranges;
+
+	// The draws passed to draw() since the last flush, as the position of their chunk and
+	// the ranges of their vertices
+	std::vector<GLshort> offsets;
+	std::vector<GLint> first;
+	std::vector<GLsizei> count;
+	std::vector<GLuint> commands;
+
+	vertexarena(): vbo(0), offsetvbo(0), commandvbo(0), capacity(0), used(0), grows(0) {}
+
+	// Growing the arena needs glCopyBufferSubData(), drawing from it glMultiDrawArraysIndirect() or
+	// glMultiDrawElementsIndirect() with a base instance
+	static bool supported() {
+		return GLEW_VERSION_4_3 || ((GLEW_VERSION_3_1 || GLEW_ARB_copy_buffer) && GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance);
+	}
 
-					// Same block as previous one? Extend it.
-					if(vis && z != 0 && blk[x][y][z] == blk[x][y][z - 1]) {
-						vertex[i - 5] = byte4(x, y, z + 1, side);
-						vertex[i - 2] = byte4(x, y, z + 1, side);
-						vertex[i - 1] = byte4(x, y + 1, z + 1, side);
-						merged++;
-					// Otherwise, add a new quad.
-					} else {
-						vertex[i++] = byte4(x, y, z, side);
-						vertex[i++] = byte4(x, y, z + 1, side);
-						vertex[i++] = byte4(x, y + 1, z, side);
-						vertex[i++] = byte4(x, y + 1, z, side);
-						vertex[i++] = byte4(x, y, z + 1, side);
-						vertex[i++] = byte4(x, y + 1, z + 1, side);
-					}
-					
-					vis = true;
-				}
-			}
+	static int roundup(int n) {
+		return (n + GRANULE - 1) / GRANULE * GRANULE;
+	}
+
+	// Find the smallest free range that fits n vertices, growing the arena if there is none
+	int alloc(int n) {
+		n = roundup(n);
+
+		std::map<int, int>::iterator best = freeranges.end();
+		for(std::map<int, int>::iterator it = freeranges.begin(); it != freeranges.end(); ++it)
+			if(it->second >= n && (best == freeranges.end() || it->second < best->second))
+				best = it;
+
+		if(best == freeranges.end()) {
+			grow(n);
+			return alloc(n);
 		}
 
-		// View from positive x
+		int offset = best->first;
+		int size = best->second;
+		freeranges.erase(best);
+		if(size > n)
+			freeranges[offset + n] = size - n;
 
-		for(int x = 0; x < CX; x++) {
-			for(int y = 0; y < CY; y++) {
-				for(int z = 0; z < CZ; z++) {
-					if(isblocked(x, y, z, x + 1, y, z)) {
-						vis = false;
-						continue;
-					}
+		used += n;
+		return offset;
+	}
+
+	// Give a range back, merging it with adjacent free ranges
+	void free(int offset, int n) {
+		n = roundup(n);
+		used -= n;
+
+		std::map<int, int>::iterator next = freeranges.lower_bound(offset);
+		if(next != freeranges.end() && offset + n == next->first) {
+			n += next->second;
+			freeranges.erase(next);
+		}
+
+		std::map<int, int>::iterator it = freeranges.lower_bound(offset);
+		if(it != freeranges.begin()) {
+			std::map<int, int>::iterator prev = it;
+			--prev;
+			if(prev->first + prev->second == offset) {
+				prev->second += n;
+				return;
+			}
+		}
+
+		freeranges[offset] = n;
+	}
+
+	// Make room for at least n more vertices at the end, keeping the contents
+	void grow(int n) {
+		int newcapacity = capacity ? capacity * 2 : 1 << 20;
+		while(newcapacity < capacity + n)
+			newcapacity *= 2;
+
+		GLuint buffer;
+		glGenBuffers(1, &buffer);
+
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		glBufferData(GL_ARRAY_BUFFER, newcapacity * sizeof(byte4), NULL, GL_DYNAMIC_DRAW);
+
+		if(capacity) {
+			glBindBuffer(GL_COPY_READ_BUFFER, vbo);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, capacity * sizeof(byte4));
+			glDeleteBuffers(1, &vbo);
+			grows++;
+		} else {
+			GLuint buffers[2];
+			glGenBuffers(2, buffers);
+			offsetvbo = buffers[0];
+			commandvbo = buffers[1];
+		}
+
+		vbo = buffer;
+
+		// The new space is free, and merges with a free range at the old end, if any
+		used += newcapacity - capacity;
+		free(capacity, newcapacity - capacity);
+		capacity = newcapacity;
+	}
+
+	// Store n vertices in a range allocated before
+	void upload(int offset, const byte4 *vertex, int n) {
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferSubData(GL_ARRAY_BUFFER, offset * sizeof *vertex, n * sizeof *vertex, vertex);
+	}
+
+	// Remember a range of a chunk at world position (x, y, z) to be drawn by flush()
+	void draw(int offset, int n, int x, int y, int z) {
+		GLshort position[4] = {(GLshort)(x - originx), (GLshort)y, (GLshort)(z - originz), 0};
+		offsets.insert(offsets.end(), position, position + 4);
+		first.push_back(offset);
+		count.push_back(n);
+	}
+
+	// Draw everything passed to draw() since the last flush, with the given view-projection matrix.
+	// All meshes must be in the given format.
+	void flush(const glm::mat4 &pv, int format) {
+		if(first.empty())
+			return;
+
+		glm::mat4 mvp = pv * glm::translate(glm::mat4(1.0f), glm::vec3(originx, 0, originz));
+		glUniformMatrix4fv(uniform_mvp, 1, GL_FALSE, glm::value_ptr(mvp));
+
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		coordpointer(format);
+		glBindBuffer(GL_ARRAY_BUFFER, offsetvbo);
+		glBufferData(GL_ARRAY_BUFFER, offsets.size() * sizeof offsets[0], offsets.data(), GL_STREAM_DRAW);
+		glEnableVertexAttribArray(attribute_offset);
+		glVertexAttribPointer(attribute_offset, 4, GL_SHORT, GL_FALSE, 0, 0);
+		glVertexAttribDivisor(attribute_offset, 1);
+
+		// Draw i is instance i, so it reads entry i of the table
+		commands.clear();
+		for(size_t i = 0; i < first.size(); i++) {
+			if(format & MESH_INDEXED) {
+				// Every mesh starts at the beginning of the index buffer, but at its own vertex
+				GLuint command[5] = {(GLuint)(count[i] / 4 * 6), 1, 0, (GLuint)first[i], (GLuint)i};
+				commands.insert(commands.end(), command, command + 5);
+			} else {
+				GLuint command[4] = {(GLuint)count[i], 1, (GLuint)first[i], (GLuint)i};
+				commands.insert(commands.end(), command, command + 4);
+			}
+		}
+
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandvbo);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof commands[0], commands.data(), GL_STREAM_DRAW);
+
+		if(format & MESH_INDEXED) {
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, quadindices.ibo);
+			glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, 0, first.size(), 0);
+		} else {
+			glMultiDrawArraysIndirect(GL_TRIANGLES, 0, first.size(), 0);
+		}
+
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+		// Other geometry is drawn without offsets
+		glVertexAttribDivisor(attribute_offset, 0);
+		glDisableVertexAttribArray(attribute_offset);
+		glVertexAttrib4f(attribute_offset, 0, 0, 0, 0);
+
+		offsets.clear();
+		first.clear();
+		count.clear();
+	}
+
+	int largest_free() const {
+		int largest = 0;
+		for(std::map<int, int>::const_iterator it = freeranges.begin(); it != freeranges.end(); ++it)
+			if(it->second > largest)
+				largest = it->second;
+		return largest;
+	}
+};
+
+static vertexarena arena;
+
+// The format new chunk meshes are made in
+static int meshformat() {
+	int format = 0;
+
+	if(indexed_quads)
+		format |= MESH_INDEXED;
+	if(compact_vertices)
+		format |= MESH_COMPACT;
+
+	return format;
+}
+
+// Division and modulo that round towards negative infinity, for mapping coordinates that can be negative
+static int floordiv(int a, int b) {
+	return (a - (a < 0 ? b - 1 : 0)) / b;
+}
+
+static int floormod(int a, int b) {
+	return a - floordiv(a, b) * b;
+}
+
+// Chunks are saved in region files, each holding REGIONX by SCY by REGIONZ chunks. A file starts with a header
+// containing the offset and length of every chunk in it, followed by the chunks themselves, run length encoded.
+// Chunks are read through a memory mapping of the file, and written with pwrite(), either in the space they
+// already had or at the end of the file. Offsets and lengths are in bytes, a length of 0 means "not saved".
+#define REGIONX 16
+#define REGIONZ 16
+#define REGIONCHUNKS (REGIONX * SCY * REGIONZ)
+
+template<int CX, int CY, int CZ, int SCY> struct regionheader {
+	char magic[4];
+	uint8_t dim[4];
+	uint32_t table[REGIONCHUNKS][2];
+};
+
+template<int CX, int CY, int CZ, int SCY> struct regionfile {
+	// Space for a chunk is rounded up to this many bytes, so it can grow a little in place
+	static const int ALIGN = 256;
+
+	int fd;
+	const uint8_t *map;
+	size_t mapsize;
+	size_t end;
+	regionheader<CX, CY, CZ, SCY> header;
+
+	regionfile(): fd(-1), map(0), mapsize(0), end(0) {}
+
+	~regionfile() {
+		if(map)
+			munmap((void *)map, mapsize);
+		if(fd >= 0)
+			close(fd);
+	}
+
+	static size_t roundup(size_t n) {
+		return (n + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+	}
+
+	bool open(const char *path) {
+		fd = ::open(path, O_RDWR | O_CREAT, 0644);
+		if(fd < 0) {
+			fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+			return false;
+		}
+
+		struct stat st;
+		if(fstat(fd, &st))
+			return false;
+
+		uint8_t dim[4] = {CX, CY, CZ, SCY};
+
+		if(!st.st_size) {
+			// A new file, start with an empty table
+			memset(&header, 0, sizeof header);
+			memcpy(header.magic, "GCR1", 4);
+			memcpy(header.dim, dim, 4);
+			if(pwrite(fd, &header, sizeof header, 0) != sizeof header)
+				return false;
+			end = roundup(sizeof header);
+		} else {
+			// Don't touch files that we do not understand
+			if(pread(fd, &header, sizeof header, 0) != sizeof header || memcmp(header.magic, "GCR1", 4) || memcmp(header.dim, dim, 4)) {
+				fprintf(stderr, "%s is not a region file with %dx%dx%d chunks, not using it\n", path, CX, CY, CZ);
+				return false;
+			}
+			end = roundup(st.st_size);
+		}
+
+		return remap();
+	}
+
+	// Map the whole file, for example after it has grown
+	bool remap() {
+		struct stat st;
+
+		if(map)
+			munmap((void *)map, mapsize);
+		map = 0;
+
+		if(fstat(fd, &st))
+			return false;
+
+		mapsize = st.st_size;
+		void *p = mmap(0, mapsize, PROT_READ, MAP_SHARED, fd, 0);
+		if(p == MAP_FAILED)
+			return false;
+
+		map = (const uint8_t *)p;
+		return true;
+	}
+
+	bool read(int i, uint8_t blk[CX][CY][CZ]) {
+		uint32_t offset = header.table[i][0];
+		uint32_t length = header.table[i][1];
+
+		if(!length)
+			return false;
+
+		if(offset + length > mapsize && !remap())
+			return false;
+		if(offset + length > mapsize)
+			return false;
+
+		// Pairs of run length and block type
+		uint8_t *out = &blk[0][0][0];
+		int n = 0;
+
+		for(uint32_t j = 0; j + 1 < length; j += 2) {
+			int run = map[offset + j];
+			if(n + run > CX * CY * CZ)
+				return false;
+			memset(out + n, map[offset + j + 1], run);
+			n += run;
+		}
+
+		return n == CX * CY * CZ;
+	}
+
+	int write(int i, const uint8_t blk[CX][CY][CZ]) {
+		const uint8_t *in = &blk[0][0][0];
+		std::vector<uint8_t> data;
+
+		for(int n = 0; n < CX * CY * CZ;) {
+			int run = 1;
+			while(run < 255 && n + run < CX * CY * CZ && in[n + run] == in[n])
+				run++;
+			data.push_back(run);
+			data.push_back(in[n]);
+			n += run;
+		}
+
+		// Overwrite the old data if there is room, otherwise append
+		uint32_t offset = header.table[i][0];
+		uint32_t length = data.size();
+
+		if(!offset || roundup(length) > roundup(header.table[i][1])) {
+			offset = end;
+			end = roundup(offset + length);
+		}
+
+		if(pwrite(fd, data.data(), length, offset) != (ssize_t)length)
+			return 0;
+
+		header.table[i][0] = offset;
+		header.table[i][1] = length;
+
+		size_t entry = (const uint8_t *)header.table[i] - (const uint8_t *)&header;
+		if(pwrite(fd, header.table[i], sizeof header.table[i], entry) != sizeof header.table[i])
+			return 0;
+
+		return length;
+	}
+};
+
+// All the region files of one world, opened when they are first needed
+template<int CX, int CY, int CZ, int SCY> struct regionstore {
+	typedef regionfile<CX, CY, CZ, SCY> file;
+	typedef std::map<std::pair<int, int>, file *> filemap;
+
+	const char *dir;
+	int seed;
+	filemap files;
+
+	// Statistics
+	long reads;
+	long writes;
+	long written;
+
+	regionstore(const char *dir, int seed): dir(dir), seed(seed), reads(0), writes(0), written(0) {}
+
+	~regionstore() {
+		for(typename filemap::iterator it = files.begin(); it != files.end(); it++)
+			delete it->second;
+	}
+
+	// Find the region file containing the chunk at chunk coordinates (x, y, z), and the index of the chunk in it
+	file *find(int x, int y, int z, int &index) {
+		if(!dir)
+			return 0;
+
+		int rx = floordiv(x, REGIONX);
+		int rz = floordiv(z, REGIONZ);
+		index = (floormod(x, REGIONX) * SCY + y + SCY / 2) * REGIONZ + floormod(z, REGIONZ);
+
+		std::pair<int, int> key(rx, rz);
+		typename filemap::iterator it = files.find(key);
+		if(it != files.end())
+			return it->second;
+
+		// Remember files that could not be opened as well, so we don't keep trying
+		char path[1024];
+		snprintf(path, sizeof path, "%s/r.%d.%d.%d", dir, seed, rx, rz);
+
+		file *r = new file();
+		if(!r->open(path)) {
+			delete r;
+			r = 0;
+		}
+
+		files[key] = r;
+		return r;
+	}
+
+	bool load(int x, int y, int z, uint8_t blk[CX][CY][CZ]) {
+		int index;
+		file *r = find(x, y, z, index);
+
+		if(!r || !r->read(index, blk))
+			return false;
+
+		reads++;
+		return true;
+	}
+
+	bool save(int x, int y, int z, const uint8_t blk[CX][CY][CZ]) {
+		int index;
+		file *r = find(x, y, z, index);
+
+		if(!r)
+			return false;
+
+		int length = r->write(index, blk);
+		if(!length)
+			return false;
+
+		writes++;
+		written += length;
+		return true;
+	}
+
+	// Close the files of regions that are far away from chunk (cx, cz)
+	void trim(int cx, int cz) {
+		int rx = floordiv(cx, REGIONX);
+		int rz = floordiv(cz, REGIONZ);
+		int rangex = SCX / REGIONX + 1;
+		int rangez = SCZ / REGIONZ + 1;
+
+		for(typename filemap::iterator it = files.begin(); it != files.end();) {
+			if(abs(it->first.first - rx) > rangex || abs(it->first.second - rz) > rangez) {
+				delete it->second;
+				files.erase(it++);
+			} else {
+				it++;
+			}
+		}
+	}
+};
+
+// Compressed storage for the blocks of one chunk. Most chunks contain only a few different block types, so
+// blocks are stored as indices into a small palette, using as few bits per block as possible. A chunk with only
+// one block type needs no indices at all, and a chunk with more than 16 types stores the blocks themselves.
+// Blocks are numbered in the same order as in a uint8_t [CX][CY][CZ] array. The two channels of light are stored
+// the same way, and with only 16 levels each, they never need more than four bits per block.
+template<int CX, int CY, int CZ> struct blockstore {
+	uint8_t bits;
+	uint8_t npalette;
+	uint8_t palette[16];
+	std::vector<uint8_t> data;
+
+	blockstore(): bits(0), npalette(1) {
+		palette[0] = 0;
+	}
+
+	static int index(int x, int y, int z) {
+		return (x * CY + y) * CZ + z;
+	}
+
+	// Smallest number of bits per block for a palette of n entries
+	static int bitsfor(int n) {
+		return n <= 1 ? 0 : n <= 2 ? 1 : n <= 4 ? 2 : n <= 16 ? 4 : 8;
+	}
+
+	uint8_t get(int i) const {
+		if(bits == 8)
+			return data[i];
+		if(!bits)
+			return palette[0];
+
+		int perbyte = 8 / bits;
+		return palette[(data[i / perbyte] >> (i % perbyte * bits)) & ((1 << bits) - 1)];
+	}
+
+	void set(int i, uint8_t type) {
+		if(bits == 8) {
+			data[i] = type;
+			return;
+		}
+
+		int p = 0;
+		while(p < npalette && palette[p] != type)
+			p++;
+
+		// Add new block types to the palette, and use more bits per block if needed
+		if(p == npalette) {
+			if(npalette == 16) {
+				repack(8);
+				data[i] = type;
+				return;
+			}
+
+			palette[npalette++] = type;
+			if(bitsfor(npalette) != bits)
+				repack(bitsfor(npalette));
+		}
+
+		if(!bits)
+			return;
+
+		int perbyte = 8 / bits;
+		int shift = i % perbyte * bits;
+		uint8_t &byte = data[i / perbyte];
+		byte = (byte & ~(((1 << bits) - 1) << shift)) | p << shift;
+	}
+
+	// Store all blocks at once, choosing the smallest representation
+	void pack(const uint8_t *blk) {
+		uint8_t lookup[256];
+		bool used[256] = {};
+
+		npalette = 0;
+		for(int i = 0; i < CX * CY * CZ; i++) {
+			if(used[blk[i]])
+				continue;
+			used[blk[i]] = true;
+			if(npalette < 16)
+				palette[npalette] = blk[i];
+			lookup[blk[i]] = npalette++;
+		}
+
+		bits = bitsfor(npalette);
+		if(bits == 8)
+			npalette = 0;
+
+		data.clear();
+		if(bits == 8) {
+			data.assign(blk, blk + CX * CY * CZ);
+		} else if(bits) {
+			int perbyte = 8 / bits;
+			data.assign(CX * CY * CZ / perbyte, 0);
+			for(int i = 0; i < CX * CY * CZ; i++)
+				data[i / perbyte] |= lookup[blk[i]] << (i % perbyte * bits);
+		}
+		data.shrink_to_fit();
+	}
+
+	// Set all blocks to the same type
+	void fill(uint8_t type) {
+		bits = 0;
+		npalette = 1;
+		palette[0] = type;
+		data.clear();
+		data.shrink_to_fit();
+	}
+
+	// Get all blocks at once
+	void unpack(uint8_t *blk) const {
+		if(bits == 8) {
+			memcpy(blk, data.data(), CX * CY * CZ);
+		} else if(!bits) {
+			memset(blk, palette[0], CX * CY * CZ);
+		} else {
+			int perbyte = 8 / bits;
+			int mask = (1 << bits) - 1;
+			for(int i = 0; i < CX * CY * CZ; i++)
+				blk[i] = palette[(data[i / perbyte] >> (i % perbyte * bits)) & mask];
+		}
+	}
+
+	// Store the blocks again with the given number of bits per block, keeping the palette
+	void repack(int newbits) {
+		uint8_t blk[CX * CY * CZ];
+		unpack(blk);
+
+		if(newbits == 8) {
+			bits = 8;
+			npalette = 0;
+			data.assign(blk, blk + CX * CY * CZ);
+			return;
+		}
+
+		uint8_t lookup[256];
+		for(int p = 0; p < npalette; p++)
+			lookup[palette[p]] = p;
+
+		bits = newbits;
+		int perbyte = 8 / bits;
+		data.assign(CX * CY * CZ / perbyte, 0);
+		for(int i = 0; i < CX * CY * CZ; i++)
+			data[i / perbyte] |= lookup[blk[i]] << (i % perbyte * bits);
+	}
+
+	size_t bytes() const {
+		return sizeof *this + data.capacity();
+	}
+};
+
+// The block a ray ran into. The face it entered through is numbered like the global face: 0, 1 and 2 are
+// the +x, +y and +z faces, and 3, 4 and 5 the -x, -y and -z faces. It is -1 if the ray started inside the block.
+// The distance is measured from the origin of the ray, in blocks.
+struct raycasthit {
+	int x;
+	int y;
+	int z;
+	int face;
+	float distance;
+	uint8_t type;
+};
+
+// A block whose light changed, and still has to be spread to its neighbours or taken away from them.
+// For taking light away, level is the light the block had in the channel being darkened.
+struct lightnode {
+	int x;
+	int y;
+	int z;
+	uint8_t level;
+};
+
+// A change of one block, as used for changing many blocks at once
+struct blockedit {
+	int x;
+	int y;
+	int z;
+	uint8_t type;
+};
+
+template<int CX, int CY, int CZ> struct basicchunk: chunkbase {
+	// Block coordinates are masked with CX - 1 etc., and must fit in the six bits compact vertices have for them
+	static_assert(!(CX & (CX - 1)) && !(CY & (CY - 1)) && !(CZ & (CZ - 1)) && CX <= 32 && CY <= 32 && CZ <= 32, "chunk sizes must be powers of two up to 32");
+	static_assert(CY % SECTIONS == 0, "chunks must be high enough to be split into sections");
+	static_assert(CX >= 4 && CY >= 4 && CZ >= 4, "chunks must be at least one brick in size");
+	static_assert(!(CX % (1 << (LODLEVELS - 1))) && !(CY % (1 << (LODLEVELS - 1))) && !(CZ % (1 << (LODLEVELS - 1))), "chunks must be a whole number of cubes of the lowest level of detail");
+
+	blockstore<CX, CY, CZ> blocks;
+	basicchunk *left, *right, *below, *above, *front, *back;
+
+	// Number of blocks that are not air, in the whole chunk and in every brick of 4 by 4 by 4 blocks,
+	// so ray casts and other queries can skip over empty space
+	int solid;
+	uint8_t bricks[CX / 4][CY / 4][CZ / 4];
+
+	// Light of every block, from sky and from lamps, compressed like the blocks. It is filled in by a lightjob,
+	// once the whole column of chunks this one is in is generated.
+	blockstore<CX, CY, CZ> skylight;
+	blockstore<CX, CY, CZ> lamplight;
+
+	basicchunk(int x, int y, int z): chunkbase(x, y, z) {
+		left = right = below = above = front = back = 0;
+		solid = 0;
+		memset(bricks, 0, sizeof bricks);
+	}
+
+	bool empty() const {
+		return !solid;
+	}
+
+	bool brickempty(int x, int y, int z) const {
+		return !bricks[x >> 2][y >> 2][z >> 2];
+	}
+
+	// Count the blocks that are not air in all bricks
+	void summarize(const uint8_t blk[CX][CY][CZ]) {
+		solid = 0;
+		memset(bricks, 0, sizeof bricks);
+
+		for(int x = 0; x < CX; x++) {
+			for(int y = 0; y < CY; y++) {
+				for(int z = 0; z < CZ; z++) {
+					if(blk[x][y][z]) {
+						solid++;
+						bricks[x >> 2][y >> 2][z >> 2]++;
+					}
+				}
+			}
+		}
+	}
+
+	// Keep the counts up to date when the block at (x, y, z) changes from type old to type
+	void occupy(int x, int y, int z, uint8_t old, uint8_t type) {
+		if(!old == !type)
+			return;
+
+		int d = type ? 1 : -1;
+		solid += d;
+		bricks[x >> 2][y >> 2][z >> 2] += d;
+	}
+
+	uint8_t get(int x, int y, int z) const {
+		// If coordinates are outside this chunk, ask the right one
+		if(x < 0)
+			return left ? left->get(x + CX, y, z) : 0;
+		if(x >= CX)
+			return right ? right->get(x - CX, y, z) : 0;
+		if(y < 0)
+			return below ? below->get(x, y + CY, z) : 0;
+		if(y >= CY)
+			return above ? above->get(x, y - CY, z) : 0;
+		if(z < 0)
+			return front ? front->get(x, y, z + CZ) : 0;
+		if(z >= CZ)
+			return back ? back->get(x, y, z - CZ) : 0;
+		return blocks.get(blocks.index(x, y, z));
+	}
+
+	// Like get(), but for the light of a block. Where there is no chunk, it is open sky.
+	uint8_t getlight(int x, int y, int z) const {
+		if(x < 0)
+			return left ? left->getlight(x + CX, y, z) : 0xf0;
+		if(x >= CX)
+			return right ? right->getlight(x - CX, y, z) : 0xf0;
+		if(y < 0)
+			return below ? below->getlight(x, y + CY, z) : 0xf0;
+		if(y >= CY)
+			return above ? above->getlight(x, y - CY, z) : 0xf0;
+		if(z < 0)
+			return front ? front->getlight(x, y, z + CZ) : 0xf0;
+		if(z >= CZ)
+			return back ? back->getlight(x, y, z - CZ) : 0xf0;
+		int i = blocks.index(x, y, z);
+		return skylight.get(i) << 4 | lamplight.get(i);
+	}
+
+	// Get the light of all blocks at once, with sky light in the high and light from lamps in the low four bits
+	void unpacklight(uint8_t *light) const {
+		uint8_t lamp[CX * CY * CZ];
+		skylight.unpack(light);
+		lamplight.unpack(lamp);
+		for(int i = 0; i < CX * CY * CZ; i++)
+			light[i] = light[i] << 4 | lamp[i];
+	}
+
+	// Change the light of a block, and mark the meshes that show it as stale
+	void setlight(int x, int y, int z, uint8_t value) {
+		int i = blocks.index(x, y, z);
+		skylight.set(i, value >> 4);
+		lamplight.set(i, value & 15);
+
+		int around[27] = {};
+		invalidate(x, y, z, around, false);
+		invalidate_neighbours(around);
+	}
+
+	void set(int x, int y, int z, uint8_t type) {
+		// If coordinates are outside this chunk, find the right one.
+		if(x < 0) {
+			if(left)
+				left->set(x + CX, y, z, type);
+			return;
+		}
+		if(x >= CX) {
+			if(right)
+				right->set(x - CX, y, z, type);
+			return;
+		}
+		if(y < 0) {
+			if(below)
+				below->set(x, y + CY, z, type);
+			return;
+		}
+		if(y >= CY) {
+			if(above)
+				above->set(x, y - CY, z, type);
+			return;
+		}
+		if(z < 0) {
+			if(front)
+				front->set(x, y, z + CZ, type);
+			return;
+		}
+		if(z >= CZ) {
+			if(back)
+				back->set(x, y, z - CZ, type);
+			return;
+		}
+
+		// Change the block
+		int i = blocks.index(x, y, z);
+		occupy(x, y, z, blocks.get(i), type);
+		blocks.set(i, type);
+		dirty = true;
+
+		int around[27] = {};
+		invalidate(x, y, z, around);
+		invalidate_neighbours(around);
+	}
+
+	// Change many blocks of this chunk at once. Coordinates are relative to this chunk, and must be inside it.
+	void set(const blockedit *edits, int n) {
+		if(!n)
+			return;
+
+		for(int i = 0; i < n; i++) {
+			int j = blocks.index(edits[i].x, edits[i].y, edits[i].z);
+			occupy(edits[i].x, edits[i].y, edits[i].z, blocks.get(j), edits[i].type);
+			blocks.set(j, edits[i].type);
+		}
+
+		dirty = true;
+
+		int around[27] = {};
+		for(int i = 0; i < n; i++)
+			invalidate(edits[i].x, edits[i].y, edits[i].z, around);
+		invalidate_neighbours(around);
+	}
+
+	// Set all blocks of this chunk to the same type
+	void fill(uint8_t type) {
+		blocks.fill(type);
+		solid = type ? CX * CY * CZ : 0;
+		memset(bricks, type ? 64 : 0, sizeof bricks);
+		dirty = true;
+		stale = ALLSECTIONS;
+
+		// All of the chunks around this one, except for the sections of those below and above that are not next to it
+		int around[27];
+		for(int i = 0; i < 27; i++)
+			around[i] = i / 3 % 3 == 0 ? 1 << (SECTIONS - 1) : i / 3 % 3 == 2 ? 1 : ALLSECTIONS;
+		around[13] = 0;
+		invalidate_neighbours(around);
+	}
+
+	// Mark the mesh sections that a change of block (x, y, z) affects as stale. Only the section with this block
+	// has to be meshed again, and the one next to it if the block is at its top or bottom. Blocks at the edge of
+	// this chunk can change the visibility and ambient occlusion of blocks in the neighbouring chunks as well,
+	// including the ones that only share an edge or a corner with it. Their sections are added to around[],
+	// at (dx + 1) * 9 + (dy + 1) * 3 + dz + 1 for the neighbour at (dx, dy, dz). A change of light only shows on
+	// the faces right in front of the block, so without occlusion only the sections next to it are marked.
+	void invalidate(int x, int y, int z, int around[27], bool occlusion = true) {
+		int height = CY / SECTIONS;
+		int k = y / height;
+		int sections = 1 << k;
+		if(y % height == 0 && k > 0)
+			sections |= 1 << (k - 1);
+		if(y % height == height - 1 && k < SECTIONS - 1)
+			sections |= 1 << (k + 1);
+		stale |= sections;
+
+		// With less detail, the neighbours look at whole cubes of blocks along the border
+		int s = 1 << lod;
+		int lo[3] = {x < s ? -1 : 0, y < s ? -1 : 0, z < s ? -1 : 0};
+		int hi[3] = {x >= CX - s ? 1 : 0, y >= CY - s ? 1 : 0, z >= CZ - s ? 1 : 0};
+
+		for(int dx = lo[0]; dx <= hi[0]; dx++)
+			for(int dy = lo[1]; dy <= hi[1]; dy++)
+				for(int dz = lo[2]; dz <= hi[2]; dz++)
+					if((dx || dy || dz) && (occlusion || !!dx + !!dy + !!dz == 1))
+						around[(dx + 1) * 9 + (dy + 1) * 3 + dz + 1] |= dy < 0 ? 1 << (SECTIONS - 1) : dy > 0 ? 1 : occlusion ? sections : 1 << k;
+	}
+
+	// The chunk at (dx, dy, dz) chunks from this one, found along x, then y, then z, the same way get() does
+	basicchunk *neighbour(int dx, int dy, int dz) {
+		basicchunk *n = this;
+		if(n && dx)
+			n = dx < 0 ? n->left : n->right;
+		if(n && dy)
+			n = dy < 0 ? n->below : n->above;
+		if(n && dz)
+			n = dz < 0 ? n->front : n->back;
+		return n;
+	}
+
+	// Mark the sections collected by invalidate() as stale in the neighbours
+	void invalidate_neighbours(const int around[27]) {
+		for(int i = 0; i < 27; i++) {
+			if(!around[i])
+				continue;
+			basicchunk *n = neighbour(i / 9 - 1, i / 3 % 3 - 1, i % 3 - 1);
+			if(n)
+				n->stale |= around[i];
+		}
+	}
+
+	// Every seed and octave samples the noise function at a different offset,
+	// so different seeds give different worlds, and octaves do not line up with each other.
+	static float seedoffset(int seed, int octave, int axis) {
+		return (poshash(octave, axis, 0x5eed, seed) & 0xffff) * (1.0 / 32.0) - 1024.0;
+	}
+
+	static float noise2d(float x, float y, int seed, int octaves, float persistence) {
+		float sum = 0;
+		float strength = 1.0;
+		float scale = 1.0;
+
+		for(int i = 0; i < octaves; i++) {
+			glm::vec2 offset(seedoffset(seed, i, 0), seedoffset(seed, i, 1));
+			sum += strength * glm::simplex(glm::vec2(x, y) * scale + offset);
+			scale *= 2.0;
+			strength *= persistence;
+		}
+
+		return sum;
+	}
+
+	static float noise3d_abs(float x, float y, float z, int seed, int octaves, float persistence) {
+		float sum = 0;
+		float strength = 1.0;
+		float scale = 1.0;
+
+		for(int i = 0; i < octaves; i++) {
+			glm::vec3 offset(seedoffset(seed, i, 0), seedoffset(seed, i, 1), seedoffset(seed, i, 2));
+			sum += strength * fabs(glm::simplex(glm::vec3(x, y, z) * scale + offset));
+			scale *= 2.0;
+			strength *= persistence;
+		}
+
+		return sum;
+	}
+
+	// Batched versions of noise2d() and noise3d_abs(), which evaluate count samples at once.
+	// They process as many samples as possible with the widest vector unit available,
+	// and return how many they did, so narrower lane types can finish the rest.
+
+	template<typename V> static int noise2d_lanes(const float *x, const float *y, float *out, int count, int seed, int octaves, float persistence) {
+		int i;
+
+		for(i = 0; i + V::N <= count; i += V::N) {
+			V vx = V::load(x + i);
+			V vy = V::load(y + i);
+			V sum = 0.0f;
+			float strength = 1.0;
+			float scale = 1.0;
+
+			for(int o = 0; o < octaves; o++) {
+				sum = sum + strength * simplex2(vx * scale + seedoffset(seed, o, 0), vy * scale + seedoffset(seed, o, 1));
+				scale *= 2.0;
+				strength *= persistence;
+			}
+
+			sum.store(out + i);
+		}
+
+		return i;
+	}
+
+	template<typename V> static int noise3d_abs_lanes(const float *x, const float *y, const float *z, float *out, int count, int seed, int octaves, float persistence) {
+		int i;
+
+		for(i = 0; i + V::N <= count; i += V::N) {
+			V vx = V::load(x + i);
+			V vy = V::load(y + i);
+			V vz = V::load(z + i);
+			V sum = 0.0f;
+			float strength = 1.0;
+			float scale = 1.0;
+
+			for(int o = 0; o < octaves; o++) {
+				sum = sum + strength * vabs(simplex3(vx * scale + seedoffset(seed, o, 0), vy * scale + seedoffset(seed, o, 1), vz * scale + seedoffset(seed, o, 2)));
+				scale *= 2.0;
+				strength *= persistence;
+			}
+
+			sum.store(out + i);
+		}
+
+		return i;
+	}
+
+	static void noise2d_batch(const float *x, const float *y, float *out, int count, int seed, int octaves, float persistence) {
+		int i = 0;
+#ifdef __AVX__
+		i += noise2d_lanes<simd8>(x + i, y + i, out + i, count - i, seed, octaves, persistence);
+#endif
+#ifdef __SSE2__
+		i += noise2d_lanes<simd4>(x + i, y + i, out + i, count - i, seed, octaves, persistence);
+#endif
+		noise2d_lanes<simd1>(x + i, y + i, out + i, count - i, seed, octaves, persistence);
+	}
+
+	static void noise3d_abs_batch(const float *x, const float *y, const float *z, float *out, int count, int seed, int octaves, float persistence) {
+		int i = 0;
+#ifdef __AVX__
+		i += noise3d_abs_lanes<simd8>(x + i, y + i, z + i, out + i, count - i, seed, octaves, persistence);
+#endif
+#ifdef __SSE2__
+		i += noise3d_abs_lanes<simd4>(x + i, y + i, z + i, out + i, count - i, seed, octaves, persistence);
+#endif
+		noise3d_abs_lanes<simd1>(x + i, y + i, z + i, out + i, count - i, seed, octaves, persistence);
+	}
+
+	// Land height noise of the column at world coordinates (x, z)
+	static float landnoise(int x, int z, int seed) {
+		float fx = x / 256.0;
+		float fz = z / 256.0;
+		float n;
+
+		if(simd_noise)
+			noise2d_batch(&fx, &fz, &n, 1, seed, 5, 0.8);
+		else
+			n = noise2d(fx, fz, seed, 5, 0.8);
+
+		return n * 4;
+	}
+
+	// Random value used to determine the type of ground at world coordinates (x, y, z)
+	static float landrandom(int x, int y, int z, int seed) {
+		float fx = x / 16.0;
+		float fy = y / 16.0;
+		float fz = z / 16.0;
+		float r;
+
+		if(simd_noise)
+			noise3d_abs_batch(&fx, &fy, &fz, &r, 1, -seed, 2, 1);
+		else
+			r = noise3d_abs(fx, fy, fz, -seed, 2, 1);
+
+		return r;
+	}
+
+	// Type of the ground block at world coordinates (x, y, z), in a column with land noise n and land height h
+	static uint8_t landtype(int x, int y, int z, float n, int h, int seed) {
+		return landtype(y, n, h, landrandom(x, y, z, seed));
+	}
+
+	// Same, with the random value r already known
+	static uint8_t landtype(int y, float n, int h, float r) {
+		// Sand layer
+		if(n + r * 5 < 4)
+			return 7;
+		// Dirt layer, but use grass blocks for the top
+		else if(n + r * 5 < 8)
+			return (h < SEALEVEL || y < h - 1) ? 1 : 3;
+		// Rock layer
+		else if(r < 1.25)
+			return 6;
+		// Sometimes, ores!
+		else
+			return 11;
+	}
+
+	// Same as the land generation in generate(), but evaluating the noise for all columns of the chunk at once,
+	// and then for all blocks below ground at once.
+	static void generate_batched(uint8_t blk[CX][CY][CZ], int ax, int ay, int az, int seed) {
+		float x2[CX * CZ];
+		float z2[CX * CZ];
+		float n[CX * CZ];
+		int h[CX * CZ];
+
+		for(int x = 0; x < CX; x++) {
+			for(int z = 0; z < CZ; z++) {
+				x2[x * CZ + z] = (x + ax * CX) / 256.0;
+				z2[x * CZ + z] = (z + az * CZ) / 256.0;
+			}
+		}
+
+		noise2d_batch(x2, z2, n, CX * CZ, seed, 5, 0.8);
+
+		// Collect all the blocks below ground level
+		static thread_local float x3[CX * CY * CZ];
+		static thread_local float y3[CX * CY * CZ];
+		static thread_local float z3[CX * CY * CZ];
+		static thread_local float r[CX * CY * CZ];
+		int count = 0;
+
+		for(int i = 0; i < CX * CZ; i++) {
+			n[i] *= 4;
+			h[i] = n[i] * 2;
+
+			for(int y = 0; y < CY && y + ay * CY < h[i]; y++) {
+				x3[count] = (i / CZ + ax * CX) / 16.0;
+				y3[count] = (y + ay * CY) / 16.0;
+				z3[count] = (i % CZ + az * CZ) / 16.0;
+				count++;
+			}
+		}
+
+		noise3d_abs_batch(x3, y3, z3, r, count, -seed, 2, 1);
+
+		// Fill in the blocks in the same order
+		count = 0;
+
+		for(int i = 0; i < CX * CZ; i++) {
+			int x = i / CZ;
+			int z = i % CZ;
+
+			for(int y = 0; y < CY; y++) {
+				if(y + ay * CY < h[i])
+					blk[x][y][z] = landtype(y + ay * CY, n[i], h[i], r[count++]);
+				else if(y + ay * CY < SEALEVEL)
+					blk[x][y][z] = 8;
+				else
+					break;
+			}
+		}
+	}
+
+	// Generate the blocks of the chunk at chunk coordinates (ax, ay, az).
+	// The result only depends on the coordinates and the seed, and no other chunk is touched,
+	// so this can safely run on any thread and in any order.
+	static void generate(uint8_t blk[CX][CY][CZ], int ax, int ay, int az, int seed) {
+		memset(blk, 0, CX * CY * CZ);
+
+		if(simd_noise) {
+			generate_batched(blk, ax, ay, az, seed);
+		} else {
+			for(int x = 0; x < CX; x++) {
+				for(int z = 0; z < CZ; z++) {
+					// Land height
+					float n = landnoise(x + ax * CX, z + az * CZ, seed);
+					int h = n * 2;
+
+					// Land blocks
+					for(int y = 0; y < CY; y++) {
+						// Are we above "ground" level?
+						if(y + ay * CY >= h) {
+							// If we are not yet up to sea level, fill with water blocks
+							if(y + ay * CY < SEALEVEL) {
+								blk[x][y][z] = 8;
+								continue;
+							// Otherwise, we are in the air
+							} else {
+								break;
+							}
+						}
+
+						blk[x][y][z] = landtype(x + ax * CX, y + ay * CY, z + az * CZ, n, h, seed);
+					}
+				}
+			}
+		}
+
+		// Trees. Since a tree can stick out into neighbouring chunks, look at all the columns
+		// close enough for a tree to reach this chunk, but only place the blocks that fall inside it.
+		struct tree {
+			int x, y, z, h;
+		} trees[(CX + 6) * (CZ + 6)];
+		int ntrees = 0;
+
+		for(int x = ax * CX - 3; x < ax * CX + CX + 3; x++) {
+			for(int z = az * CZ - 3; z < az * CZ + CZ + 3; z++) {
+				// One in 256 columns might get a tree
+				uint32_t r = poshash(x, 0, z, seed);
+				if(r & 0xff)
+					continue;
+
+				// But only if there is grass on top
+				float n = landnoise(x, z, seed);
+				int h = n * 2;
+				if(h < SEALEVEL || landtype(x, h - 1, z, n, h, seed) != 3)
+					continue;
+
+				struct tree t = {x, h, z, (int)((r >> 8) & 0x3) + 3};
+				if(t.y + t.h + 3 >= ay * CY && t.y < ay * CY + CY)
+					trees[ntrees++] = t;
+			}
+		}
+
+		// Leaves only grow in air
+		for(int i = 0; i < ntrees; i++) {
+			const struct tree &t = trees[i];
+			for(int ix = -3; ix <= 3; ix++) {
+				for(int iy = -3; iy <= 3; iy++) {
+					for(int iz = -3; iz <= 3; iz++) {
+						int x = t.x + ix - ax * CX;
+						int y = t.y + t.h + iy - ay * CY;
+						int z = t.z + iz - az * CZ;
+						if(x < 0 || x >= CX || y < 0 || y >= CY || z < 0 || z >= CZ || blk[x][y][z])
+							continue;
+						if(ix * ix + iy * iy + iz * iz < 8 + (int)(poshash(t.x + ix, t.y + t.h + iy, t.z + iz, seed) & 1))
+							blk[x][y][z] = 4;
+					}
+				}
+			}
+		}
+
+		// Trunks, which may go through the leaves of other trees
+		for(int i = 0; i < ntrees; i++) {
+			const struct tree &t = trees[i];
+			int x = t.x - ax * CX;
+			int z = t.z - az * CZ;
+			if(x < 0 || x >= CX || z < 0 || z >= CZ)
+				continue;
+			for(int j = 0; j < t.h; j++) {
+				int y = t.y + j - ay * CY;
+				if(y >= 0 && y < CY)
+					blk[x][y][z] = 5;
+			}
+		}
+	}
+
+	// Generate the terrain of this chunk right away, on the calling thread
+	void noise(int seed) {
+		if(noised)
+			return;
+		else
+			noised = true;
+
+		uint8_t blk[CX][CY][CZ];
+		generate(blk, ax, ay, az, seed);
+		blocks.pack(&blk[0][0][0]);
+		summarize(blk);
+		changed = true;
+	}
+
+	// Store the blocks generated by a worker thread
+	void install(const uint8_t newblk[CX][CY][CZ]) {
+		blocks.pack(&newblk[0][0][0]);
+		summarize(newblk);
+		noised = true;
+		generating = false;
+
+		// The faces along the borders of the neighbours might have changed as well
+		changed = true;
+		if(left)
+			left->changed = true;
+		if(right)
+			right->changed = true;
+		if(below)
+			below->changed = true;
+		if(above)
+			above->changed = true;
+		if(front)
+			front->changed = true;
+		if(back)
+			back->changed = true;
+	}
+
+	// Mesh this chunk with another level of detail. The neighbours change as well, since the faces along a border
+	// between two levels are always made.
+	void setlod(int level) {
+		lod = level;
+		changed = true;
+
+		basicchunk *n[6] = {left, right, below, above, front, back};
+		for(int i = 0; i < 6; i++)
+			if(n[i])
+				n[i]->changed = true;
+	}
+
+	// A chunk can only be meshed when it and all its neighbours have been generated and lit
+	bool ready() const {
+		return noised && lit
+			&& (!left || (left->noised && left->lit)) && (!right || (right->noised && right->lit))
+			&& (!below || (below->noised && below->lit)) && (!above || (above->noised && above->lit))
+			&& (!front || (front->noised && front->lit)) && (!back || (back->noised && back->lit));
+	}
+
+	// Hand a copy of this chunk to the mesher threads, to mesh either all of it or only the stale sections.
+	// Meshes with less detail are always made whole, since their cubes of blocks can span sections.
+	void update() {
+		int sections = changed || lod ? ALLSECTIONS : stale;
+		changed = false;
+		stale = 0;
+		meshing = true;
+		jobqueue.push(new meshjob<CX, CY, CZ>(this, sections));
+	}
+
+	// Whether the uploaded mesh can be changed one section at a time, for a new mesh in the given format
+	bool patchable(int format) const {
+		return elements && format == this->format && (arena_mode ? arenaoffset >= 0 : slot >= 0);
+	}
+
+	// Replace n vertices of the uploaded mesh, starting at vertex first
+	void patch(int first, const byte4 *vertex, int n) {
+		if(arenaoffset >= 0) {
+			arena.upload(arenaoffset + first, vertex, n);
+			return;
+		}
+
+		glBindBuffer(GL_ARRAY_BUFFER, slots.vbo[slot]);
+		glBufferSubData(GL_ARRAY_BUFFER, first * sizeof *vertex, n * sizeof *vertex, vertex);
+	}
+
+	// Upload the vertices produced by the mesher, must be called from the main thread
+	void upload(const byte4 *vertex, int n) {
+		elements = n;
+
+		if(format & MESH_INDEXED)
+			quadindices.reserve(n / 4);
+
+		// Give back the storage of the mode we are not using
+		if(arena_mode && slot >= 0) {
+			slots.release(slot);
+			slot = -1;
+		}
+		if((!arena_mode || !n || n > arenasize) && arenaoffset >= 0) {
+			arena.free(arenaoffset, arenasize);
+			arenaoffset = -1;
+			arenasize = 0;
+		}
+
+		// If this chunk is empty, no need to allocate a chunk slot.
+		if(!elements) {
+			if(slot >= 0) {
+				slots.release(slot);
+				slot = -1;
+			}
+			return;
+		}
+
+		if(arena_mode) {
+			// Reuse our range in the arena if the new mesh still fits, otherwise get a new one
+			if(arenaoffset < 0) {
+				arenaoffset = arena.alloc(n);
+				arenasize = vertexarena::roundup(n);
+			}
+
+			arena.upload(arenaoffset, vertex, n);
+			return;
+		}
+
+		// If we don't have an active slot, get one
+		if(slot < 0)
+			slot = slots.alloc(this);
+
+		// Upload vertices
+
+		glBindBuffer(GL_ARRAY_BUFFER, slots.vbo[slot]);
+		glBufferData(GL_ARRAY_BUFFER, n * sizeof *vertex, vertex, GL_STATIC_DRAW);
+	}
+
+	// Give back the storage of this chunk and detach it from its neighbours, when it is no longer needed
+	void unload() {
+		if(slot >= 0) {
+			slots.release(slot);
+			slot = -1;
+		}
+		if(arenaoffset >= 0) {
+			arena.free(arenaoffset, arenasize);
+			arenaoffset = -1;
+			arenasize = 0;
+		}
+		elements = 0;
+
+		if(left)
+			left->right = 0;
+		if(right)
+			right->left = 0;
+		if(below)
+			below->above = 0;
+		if(above)
+			above->below = 0;
+		if(front)
+			front->back = 0;
+		if(back)
+			back->front = 0;
+		left = right = below = above = front = back = 0;
+
+		dead = true;
+	}
+
+	// Draw the opaque part of the mesh, which comes before the sections with water and glass
+	void render(const glm::mat4 &mvp) {
+		// Don't start meshing again until the previous mesh has been uploaded
+		if((changed || stale) && !meshing)
+			update();
+
+		// Meshes in an old format are not drawn until they are replaced
+		if(!elements || format != meshformat())
+			return;
+
+		drawrange(mvp, 0, section[SECTIONS].first);
+	}
+
+	// Whether this chunk has any water or glass to draw after all the opaque chunks
+	bool blends() const {
+		return elements && format == meshformat() && section[SECTIONS].first < elements;
+	}
+
+	void renderblended(const glm::mat4 &mvp) {
+		drawrange(mvp, section[SECTIONS].first, elements - section[SECTIONS].first);
+	}
+
+	void drawrange(const glm::mat4 &mvp, int first, int count) {
+		if(!count)
+			return;
+
+		// Chunks in the arena are drawn all at once later
+		if(arenaoffset >= 0) {
+			arena.draw(arenaoffset + first, count, ax * CX, ay * CY, az * CZ);
+			return;
+		}
+
+		slots.touch(slot);
+
+		glUniformMatrix4fv(uniform_mvp, 1, GL_FALSE, glm::value_ptr(mvp));
+
+		glBindBuffer(GL_ARRAY_BUFFER, slots.vbo[slot]);
+		coordpointer(format);
+
+		if(format & MESH_INDEXED) {
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, quadindices.ibo);
+			glDrawElements(GL_TRIANGLES, count / 4 * 6, GL_UNSIGNED_INT, (GLvoid *)(first / 4 * 6 * sizeof(GLuint)));
+		} else {
+			glDrawArrays(GL_TRIANGLES, first, count);
+		}
+	}
+};
+
+typedef basicchunk<CX, CY, CZ> chunk;
+
+// Memory that every thread reuses for all the meshes it makes, so meshing needs no allocations and
+// little stack. It is only touched as far as the meshes actually need.
+template<int CX, int CY, int CZ> struct meshscratch {
+	byte4 vertex[MAXQUADS * 6];
+	byte4 blended[MAXQUADS * 6];
+	int mask[MAXDIM * MAXDIM];
+	uint64_t column[CX + 2][CZ + 2][5];
+	uint64_t visible[6][CX][CZ];
+	uint8_t seen[CX][CY][CZ];
+	int stack[CX * CY * CZ];
+};
+
+template<int CX, int CY, int CZ> static meshscratch<CX, CY, CZ> &scratch() {
+	static thread_local std::unique_ptr<meshscratch<CX, CY, CZ> > s;
+
+	if(!s)
+		s.reset(new meshscratch<CX, CY, CZ>);
+
+	return *s;
+}
+
+// Which blocks in column a have a visible face towards the blocks next to them in column b, following the same
+// rules as isblocked(). Both columns have one bit per block for every transparency type, as in meshscratch::column.
+static inline uint64_t visiblebits(const uint64_t *a, const uint64_t *b) {
+	return ~a[2] & (b[1] | ~(b[0] | (a[3] & b[3]) | (a[4] & b[4])));
+}
+
+// Find the visible faces of all blocks at once. Every column of blocks along the y axis, including the border,
+// is turned into a bitmask per transparency type, so isblocked() can be done for a whole column with a few
+// logical operations. Afterwards, bit y of visible[f][x][z] is set if face f of block (x, y, z) can be seen.
+template<int CX, int CY, int CZ> void meshjob<CX, CY, CZ>::visiblefaces() {
+	uint64_t (*column)[CZ + 2][5] = scratch<CX, CY, CZ>().column;
+	uint64_t (*visible)[CX][CZ] = scratch<CX, CY, CZ>().visible;
+	const uint64_t inside = ((1ull << CY) - 1) << 1;
+
+	memset(column, 0, sizeof scratch<CX, CY, CZ>().column);
+
+	for(int x = 0; x < CX + 2; x++)
+		for(int y = 0; y < CY + 2; y++)
+			for(int z = 0; z < CZ + 2; z++)
+				column[x][z][transparent[blk[x][y][z]]] |= 1ull << y;
+
+	for(int x = 0; x < CX; x++) {
+		for(int z = 0; z < CZ; z++) {
+			const uint64_t *c = column[x + 1][z + 1];
+
+			// The neighbours along the y axis are in the same column, one bit further
+			uint64_t below[5], above[5];
+			for(int t = 0; t < 5; t++) {
+				below[t] = c[t] << 1;
+				above[t] = c[t] >> 1;
+			}
+
+			visible[0][x][z] = (visiblebits(c, column[x][z + 1]) & inside) >> 1;
+			visible[1][x][z] = (visiblebits(c, column[x + 2][z + 1]) & inside) >> 1;
+			visible[2][x][z] = (visiblebits(c, below) & inside) >> 1;
+			visible[3][x][z] = (visiblebits(c, above) & inside) >> 1;
+			visible[4][x][z] = (visiblebits(c, column[x + 1][z]) & inside) >> 1;
+			visible[5][x][z] = (visiblebits(c, column[x + 1][z + 2]) & inside) >> 1;
+		}
+	}
+}
+
+// Fill mask with the texture of every visible face in slice s of direction f, and 0 where there is none.
+// Only the blocks with y0 <= y < y1 are looked at.
+template<int CX, int CY, int CZ> void meshjob<CX, CY, CZ>::slicefaces(int f, int s, int y0, int y1, int *mask) const {
+	const struct facedir &fd = facedirs[f];
+	int dim[3] = {CX, CY, CZ};
+	int lo[3] = {0, y0, 0};
+	int hi[3] = {CX, y1, CZ};
+	int nv = dim[fd.v];
+
+	if(!bitmask) {
+		// Check every block on its own
+		for(int u = lo[fd.u]; u < hi[fd.u]; u++) {
+			for(int v = lo[fd.v]; v < hi[fd.v]; v++) {
+				int p[3];
+				p[fd.d] = s;
+				p[fd.u] = u;
+				p[fd.v] = v;
+
+				// Line of sight blocked?
+				if(isblocked(p[0], p[1], p[2], p[0] + fd.n[0], p[1] + fd.n[1], p[2] + fd.n[2]))
+					mask[u * nv + v] = 0;
+				else
+					mask[u * nv + v] = faceinfo(p[0], p[1], p[2], f);
+			}
+		}
+		return;
+	}
+
+	const uint64_t (*visible)[CZ] = scratch<CX, CY, CZ>().visible[f];
+	const uint64_t (*column)[CZ + 2][5] = scratch<CX, CY, CZ>().column;
+
+	// A slice across the y axis takes one bit from every column
+	if(fd.d == 1) {
+		for(int x = 0; x < CX; x++)
+			for(int z = 0; z < CZ; z++)
+				mask[x * nv + z] = visible[x][z] >> s & 1 ? faceinfo(x, s, z, f, column) : 0;
+		return;
+	}
+
+	// Other slices contain whole columns, only look at the blocks whose bits are set
+	for(int u = lo[fd.u]; u < hi[fd.u]; u++)
+		for(int v = lo[fd.v]; v < hi[fd.v]; v++)
+			mask[u * nv + v] = 0;
+
+	int across = fd.d == 0 ? 2 : 0;
+	uint64_t range = ((1ull << y1) - 1) & ~((1ull << y0) - 1);
+
+	for(int i = 0; i < dim[across]; i++) {
+		int p[3];
+		p[fd.d] = s;
+		p[across] = i;
+
+		for(uint64_t bits = visible[p[0]][p[2]] & range; bits; bits &= bits - 1) {
+			p[1] = __builtin_ctzll(bits);
+			mask[p[fd.u] * nv + p[fd.v]] = faceinfo(p[0], p[1], p[2], f, column);
+		}
+	}
+}
+
+// Make quads for the visible faces of all blocks with y0 <= y < y1. Opaque faces are added to vertex[0] and part[0],
+// water and glass to vertex[1] and part[1], which keep count of the vertices and quads. Faces are never merged
+// across y0 or y1.
+template<int CX, int CY, int CZ> void meshjob<CX, CY, CZ>::meshrange(int y0, int y1, byte4 *vertex[2], meshsection *part[2]) {
+	int *mask = scratch<CX, CY, CZ>().mask;
+	int dim[3] = {CX, CY, CZ};
+	int lo[3] = {0, y0, 0};
+	int hi[3] = {CX, y1, CZ};
+
+	for(int f = 0; f < 6; f++) {
+		const struct facedir &fd = facedirs[f];
+		int nv = dim[fd.v];
+
+		for(int s = lo[fd.d]; s < hi[fd.d]; s++) {
+			// Find all visible faces in this slice
+			slicefaces(f, s, y0, y1, mask);
+
+			// Merge identical faces into as few quads as possible
+			for(int u = lo[fd.u]; u < hi[fd.u]; u++) {
+				for(int v = lo[fd.v]; v < hi[fd.v];) {
+					int tex = mask[u * nv + v];
+
+					if(!tex) {
+						v++;
+						continue;
+					}
+
+					// Extend along the v axis while the face stays the same
+					int w = 1;
+					while(v + w < hi[fd.v] && mask[u * nv + v + w] == tex)
+						w++;
+
+					// With greedy meshing, also extend the whole row along the u axis
+					int h = 1;
+					if(greedy) {
+						for(; u + h < hi[fd.u]; h++) {
+							int k;
+							for(k = 0; k < w; k++)
+								if(mask[(u + h) * nv + v + k] != tex)
+									break;
+							if(k < w)
+								break;
+						}
+					}
+
+					// Clear the merged faces so they are not emitted twice
+					for(int du = 0; du < h; du++)
+						for(int dv = 0; dv < w; dv++)
+							mask[(u + du) * nv + v + dv] = 0;
+
+					int p[3];
+					p[fd.d] = s;
+					p[fd.u] = u;
+					p[fd.v] = v;
+					meshsection *to = part[tex >> 16];
+					to->count = emitquad(vertex[tex >> 16], to->count, f, p[0], p[1], p[2], h, w, tex & 0xffff, format);
+					to->quads++;
+					to->merged += w * h - 1;
+					v += w;
+				}
+			}
+		}
+	}
+}
+
+template<int CX, int CY, int CZ> void meshjob<CX, CY, CZ>::run() {
+	byte4 *vertex[2] = {scratch<CX, CY, CZ>().vertex, scratch<CX, CY, CZ>().blended};
+	int height = CY / SECTIONS;
+	int start[MESHSECTIONS];
+	int n[2];
+
+	if(bitmask)
+		visiblefaces();
+
+	for(;;) {
+		n[0] = n[1] = 0;
+		for(int k = 0; k < SECTIONS; k++) {
+			if(!(sections & 1 << k))
+				continue;
+
+			// Opaque faces go into section k, water and glass into section k + SECTIONS
+			byte4 *to[2];
+			meshsection *part[2];
+			for(int b = 0; b < 2; b++) {
+				part[b] = &section[k + b * SECTIONS];
+				part[b]->count = part[b]->quads = part[b]->merged = 0;
+				start[k + b * SECTIONS] = n[b];
+				to[b] = vertex[b] + n[b];
+			}
+
+			meshrange(k * height, (k + 1) * height, to, part);
+			n[0] += part[0]->count;
+			n[1] += part[1]->count;
+		}
+
+		if(!patch)
+			break;
+
+		// If a section outgrew its room, the buffer of the chunk has to be laid out again, with all sections
+		int k;
+		for(k = 0; k < MESHSECTIONS; k++)
+			if(sections & 1 << k % SECTIONS && section[k].count > section[k].room)
+				break;
+		if(k == MESHSECTIONS)
+			break;
+
+		patch = false;
+		sections = ALLSECTIONS;
+	}
+
+	// A new buffer leaves room for every section to grow by an eighth, and by at least a few quads.
+	// Most chunks have no water or glass at all, those sections only get room if they have faces.
+	if(!patch) {
+		int v = format & MESH_INDEXED ? 4 : 6;
+		int first = 0;
+
+		for(int k = 0; k < MESHSECTIONS; k++) {
+			section[k].first = first;
+			section[k].room = (k < SECTIONS ? n[0] || n[1] : section[k].count) ? section[k].count + (section[k].quads / 8 + 8) * v : 0;
+			first += section[k].room;
+		}
+	}
+
+	// Only the sections that were meshed go into the vertices, each one padded to its room
+	int total = 0;
+	for(int k = 0; k < MESHSECTIONS; k++)
+		if(sections & 1 << k % SECTIONS)
+			total += section[k].room;
+
+	vertices.assign(total, byte4(0, 0, 0, 0));
+	total = 0;
+	quads = 0;
+	merged = 0;
+
+	for(int k = 0; k < MESHSECTIONS; k++) {
+		if(sections & 1 << k % SECTIONS) {
+			byte4 *from = vertex[k / SECTIONS] + start[k];
+			std::copy(from, from + section[k].count, vertices.begin() + total);
+			total += section[k].room;
+		}
+
+		quads += section[k].quads;
+		merged += section[k].merged;
+	}
+
+	connectivity();
+}
+
+// Find out which faces of the chunk can see each other through blocks that are not opaque.
+// connects[f] gets a bit set for every face that is reachable from face f.
+template<int CX, int CY, int CZ> void meshjob<CX, CY, CZ>::connectivity() {
+	uint8_t (*seen)[CY][CZ] = scratch<CX, CY, CZ>().seen;
+	int *stack = scratch<CX, CY, CZ>().stack;
+
+	memset(seen, 0, sizeof scratch<CX, CY, CZ>().seen);
+	memset(connects, 0, sizeof connects);
+
+	for(int x = 0; x < CX; x++) {
+		for(int y = 0; y < CY; y++) {
+			for(int z = 0; z < CZ; z++) {
+				if(seen[x][y][z] || (get(x, y, z) && !transparent[get(x, y, z)]))
+					continue;
+
+				// Flood fill this pocket of open space, and note which faces it touches
+				int faces = 0;
+				int n = 0;
+				seen[x][y][z] = 1;
+				stack[n++] = (x * CY + y) * CZ + z;
+
+				while(n) {
+					int i = stack[--n];
+					int p[3] = {i / (CY * CZ), i / CZ % CY, i % CZ};
+					int dim[3] = {CX, CY, CZ};
+
+					for(int f = 0; f < 6; f++) {
+						const struct facedir &fd = facedirs[f];
+						int q[3] = {p[0] + fd.n[0], p[1] + fd.n[1], p[2] + fd.n[2]};
+
+						if(q[fd.d] < 0 || q[fd.d] >= dim[fd.d]) {
+							faces |= 1 << f;
+							continue;
+						}
+
+						uint8_t b = get(q[0], q[1], q[2]);
+						if(seen[q[0]][q[1]][q[2]] || (b && !transparent[b]))
+							continue;
+
+						seen[q[0]][q[1]][q[2]] = 1;
+						stack[n++] = (q[0] * CY + q[1]) * CZ + q[2];
+					}
+				}
+
+				for(int f = 0; f < 6; f++)
+					if(faces & (1 << f))
+						connects[f] |= faces;
+			}
+		}
+	}
+}
+
+// Number of meshes uploaded whole, and patched one section at a time
+static long meshed;
+static long patched;
+
+template<int CX, int CY, int CZ> int meshjob<CX, CY, CZ>::finish() {
+	c->meshing = false;
+	if(c->dead)
+		return 0;
+
+	// If the mesh format changed while we were busy, or the buffer we were going to patch is gone, start over
+	if(format != meshformat() || (patch && !c->patchable(format))) {
+		c->changed = true;
+		return 0;
+	}
+
+	c->format = format;
+	c->quads = quads;
+	c->merged = merged;
+	memcpy(c->connects, connects, sizeof connects);
+	memcpy(c->section, section, sizeof section);
+
+	if(!patch) {
+		c->upload(vertices.data(), vertices.size());
+		meshed++;
+		return vertices.empty() ? 0 : 1;
+	}
+
+	int offset = 0;
+	for(int k = 0; k < MESHSECTIONS; k++) {
+		if(sections & 1 << k % SECTIONS) {
+			c->patch(section[k].first, &vertices[offset], section[k].room);
+			offset += section[k].room;
+		}
+	}
+
+	patched++;
+	return 1;
+}
+
+template<int CX, int CY, int CZ> meshjob<CX, CY, CZ>::meshjob(chunk *c, int sections): job(c->distance), c(c), greedy(greedy_meshing), bitmask(bitmask_faces), format(meshformat()), sections(sections) {
+	// Only sections of a mesh that is already uploaded in the same format can be replaced
+	patch = sections != ALLSECTIONS && c->patchable(format);
+	if(!patch)
+		this->sections = ALLSECTIONS;
+	memcpy(section, c->section, sizeof section);
+
+	// Unpack the inside of the chunk all at once, only the border comes from the neighbours
+	uint8_t inner[CX][CY][CZ];
+	c->blocks.unpack(&inner[0][0][0]);
+
+	for(int x = -1; x <= CX; x++) {
+		for(int y = -1; y <= CY; y++) {
+			if(x >= 0 && x < CX && y >= 0 && y < CY) {
+				blk[x + 1][y + 1][0] = c->get(x, y, -1);
+				memcpy(&blk[x + 1][y + 1][1], inner[x][y], CZ);
+				blk[x + 1][y + 1][CZ + 1] = c->get(x, y, CZ);
+				continue;
+			}
+
+			for(int z = -1; z <= CZ; z++)
+				blk[x + 1][y + 1][z + 1] = c->get(x, y, z);
+		}
+	}
+
+	// Same for the light
+	c->unpacklight(&inner[0][0][0]);
+
+	for(int x = -1; x <= CX; x++) {
+		for(int y = -1; y <= CY; y++) {
+			if(x >= 0 && x < CX && y >= 0 && y < CY) {
+				light[x + 1][y + 1][0] = c->getlight(x, y, -1);
+				memcpy(&light[x + 1][y + 1][1], inner[x][y], CZ);
+				light[x + 1][y + 1][CZ + 1] = c->getlight(x, y, CZ);
+				continue;
+			}
+
+			for(int z = -1; z <= CZ; z++)
+				light[x + 1][y + 1][z + 1] = c->getlight(x, y, z);
+		}
+	}
+
+	// Distant chunks get a mesh with less detail, which is always merged as much as possible
+	lod = c->lod;
+	if(lod) {
+		greedy = true;
+		coarsen();
+	}
+
+	skirts();
+}
+
+// Replace every cube of 2^lod blocks along each side by the most common block in it, or by air if it is mostly air,
+// and its light by the brightest sky and block light in it. Only faces between whole cubes are left, which greedy
+// meshing merges into large quads. The padding gets the cubes of the neighbours along the border.
+template<int CX, int CY, int CZ> void meshjob<CX, CY, CZ>::coarsen() {
+	int s = 1 << lod;
+
+	for(int cx = -1; cx <= CX / s; cx++) {
+		for(int cy = -1; cy <= CY / s; cy++) {
+			for(int cz = -1; cz <= CZ / s; cz++) {
+				// Cubes only touching the chunk along an edge or in a corner never matter
+				int outside = (cx < 0 || cx == CX / s) + (cy < 0 || cy == CY / s) + (cz < 0 || cz == CZ / s);
+				if(outside > 1)
+					continue;
+
+				int count[16] = {};
+				int sky = 0;
+				int lamp = 0;
+
+				for(int x = cx * s; x < cx * s + s; x++) {
+					for(int y = cy * s; y < cy * s + s; y++) {
+						for(int z = cz * s; z < cz * s + s; z++) {
+							bool inside = !outside;
+							count[inside ? get(x, y, z) : c->get(x, y, z)]++;
+							uint8_t l = inside ? light[x + 1][y + 1][z + 1] : c->getlight(x, y, z);
+							sky = std::max(sky, l >> 4);
+							lamp = std::max(lamp, l & 15);
+						}
+					}
+				}
+
+				int type = 0;
+				if(count[0] * 2 <= s * s * s) {
+					type = 1;
+					for(int b = 2; b < 16; b++)
+						if(count[b] > count[type])
+							type = b;
+				}
+
+				// Fill the whole cube, as far as it lies inside the chunk and its padding
+				for(int x = std::max(cx * s, -1); x < std::min(cx * s + s, CX + 1); x++) {
+					for(int y = std::max(cy * s, -1); y < std::min(cy * s + s, CY + 1); y++) {
+						for(int z = std::max(cz * s, -1); z < std::min(cz * s + s, CZ + 1); z++) {
+							blk[x + 1][y + 1][z + 1] = type;
+							light[x + 1][y + 1][z + 1] = sky << 4 | lamp;
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+// Where a neighbour is meshed with another level of detail, its surface does not line up with ours. Treat it as
+// open sky, so the faces along that border are always made, and close the gaps between the two meshes.
+template<int CX, int CY, int CZ> void meshjob<CX, CY, CZ>::skirts() {
+	const chunkbase *n[6] = {c->left, c->right, c->below, c->above, c->front, c->back};
+	int dim[3] = {CX + 2, CY + 2, CZ + 2};
+
+	for(int f = 0; f < 6; f++) {
+		if(!n[f] || n[f]->lod == lod)
+			continue;
+
+		const struct facedir &fd = facedirs[f];
+		int p[3];
+		p[fd.d] = fd.n[fd.d] < 0 ? 0 : dim[fd.d] - 1;
+
+		for(p[fd.u] = 0; p[fd.u] < dim[fd.u]; p[fd.u]++) {
+			for(p[fd.v] = 0; p[fd.v] < dim[fd.v]; p[fd.v]++) {
+				blk[p[0]][p[1]][p[2]] = 0;
+				light[p[0]][p[1]][p[2]] = 0xf0;
+			}
+		}
+	}
+}
+
+int slotmanager::alloc(chunkbase *c) {
+	int i;
+
+	if(nfree) {
+		i = freeslots[--nfree];
+		used++;
+		if(used > peak)
+			peak = used;
+
+		// If the slot is new, create a new VBO
+		if(!vbo[i])
+			glGenBuffers(1, &vbo[i]);
+	} else {
+		// Otherwise, steal it from the previous slot owner
+		i = lru;
+		unlink(i);
+		owner[i]->slot = -1;
+		owner[i]->elements = 0;
+		owner[i]->changed = true;
+		evictions++;
+	}
+
+	owner[i] = c;
+	append(i);
+	allocations++;
+	return i;
+}
+
+// Number of chunks being generated by the worker threads
+static int generating;
+
+// Generates the terrain of a chunk on a worker thread
+template<int CX, int CY, int CZ> struct genjob: job {
+	typedef basicchunk<CX, CY, CZ> chunk;
+
+	chunk *c;
+	int ax, ay, az;
+	int seed;
+	uint8_t blk[CX][CY][CZ];
+
+	genjob(chunk *c, int seed, float priority): job(priority), c(c), ax(c->ax), ay(c->ay), az(c->az), seed(seed) {
+		c->generating = true;
+		generating++;
+	}
+
+	void run() {
+		chunk::generate(blk, ax, ay, az, seed);
+	}
+
+	int finish() {
+		generating--;
+		if(c->dead) {
+			c->generating = false;
+		} else {
+			// Generated terrain is the same every time, so it does not have to be saved until it is edited
+			c->install(blk);
+		}
+		return 0;
+	}
+};
+
+// Number of columns of chunks being lit by the worker threads
+static int lighting;
+
+template<int CX, int CY, int CZ, int SCX, int SCY, int SCZ> struct basicsuperchunk;
+
+// Lights a column of chunks from scratch on a worker thread, once all of its chunks are generated. It works on a
+// copy of the blocks of the column alone. The light that crosses the border with the neighbouring columns, in either
+// direction, is spread by the superchunk when the job is finished.
+template<int CX, int CY, int CZ, int SCX, int SCY, int SCZ> struct lightjob: job {
+	typedef basicchunk<CX, CY, CZ> chunk;
+	typedef basicsuperchunk<CX, CY, CZ, SCX, SCY, SCZ> superchunk;
+
+	superchunk *w;
+	chunk *col[SCY];
+	uint8_t blk[SCY][CX][CY][CZ];
+	uint8_t sky[SCY][CX][CY][CZ];
+	uint8_t lamp[SCY][CX][CY][CZ];
+	double time;
+
+	lightjob(superchunk *w, chunk **column, float priority): job(priority), w(w), time(0) {
+		for(int y = 0; y < SCY; y++) {
+			col[y] = column[y];
+			col[y]->lighting = true;
+			col[y]->blocks.unpack(&blk[y][0][0][0]);
+		}
+		lighting++;
+	}
+
+	// A block of the copy, with y counted from the bottom of the whole column
+	static uint8_t &at(uint8_t (*a)[CX][CY][CZ], int x, int y, int z) {
+		return a[y / CY][x][y % CY][z];
+	}
+
+	void run();
+	int finish();
+};
+
+// The six planes of the view frustum, extracted from a view-projection matrix.
+// A point p is inside when a * p.x + b * p.y + c * p.z + d >= 0 for all planes.
+struct frustum {
+	float a[6], b[6], c[6], d[6];
+
+	void extract(const glm::mat4 &pv) {
+		for(int i = 0; i < 6; i++) {
+			// Left, right, bottom, top, near and far are the sum or difference of the last row and one of the others
+			int row = i / 2;
+			float sign = (i & 1) ? -1 : 1;
+			a[i] = pv[0][3] + sign * pv[0][row];
+			b[i] = pv[1][3] + sign * pv[1][row];
+			c[i] = pv[2][3] + sign * pv[2][row];
+			d[i] = pv[3][3] + sign * pv[3][row];
+		}
+	}
+
+	// Test n boxes of size (sx, sy, sz) with their lowest corners at (x[i], y[i], z[i]), and set inside[i] to
+	// whether they intersect the frustum. This is conservative, boxes near the corners of the frustum may be
+	// reported as inside. The loops are kept simple and branch free, so the compiler can vectorize them.
+	void cull(const float *x, const float *y, const float *z, int n, float sx, float sy, float sz, uint8_t *inside) const {
+		for(int i = 0; i < n; i++)
+			inside[i] = 1;
+
+		for(int p = 0; p < 6; p++) {
+			// Only the corner furthest along the plane normal matters
+			float pa = a[p];
+			float pb = b[p];
+			float pc = c[p];
+			float pd = d[p] + (pa > 0 ? pa * sx : 0) + (pb > 0 ? pb * sy : 0) + (pc > 0 ? pc * sz : 0);
+
+			for(int i = 0; i < n; i++)
+				inside[i] &= pa * x[i] + pb * y[i] + pc * z[i] + pd >= 0;
+		}
+	}
+};
+
+// All the chunks around the camera. The grid is used as a ring: the chunk with chunk coordinates (x, y, z)
+// lives in c[floormod(x, SCX)][y + SCY / 2][floormod(z, SCZ)], so when the camera moves only the chunks that
+// fall off one side of the grid have to be replaced by new ones on the other side.
+template<int CX, int CY, int CZ, int SCX, int SCY, int SCZ> struct basicsuperchunk {
+	typedef basicchunk<CX, CY, CZ> chunk;
+
+	chunk *c[SCX][SCY][SCZ];
+	int seed;
+	int generate_ahead;
+
+	// Chunks within this many chunks of the camera are kept loaded
+	int radius;
+
+	// Chunk the camera is in, the grid covers SCX / 2 chunks to either side of it
+	int cx;
+	int cz;
+
+	// Unloaded chunks that still have jobs in flight
+	std::vector<chunk *> dead;
+
+	// Where chunks are saved, and how many changed chunks may be written back per frame
+	regionstore<CX, CY, CZ, SCY> regions;
+	int save_budget;
+
+	// Lowest corner of all chunks, in the same order as c, for frustum culling
+	float minx[SCX * SCY * SCZ];
+	float miny[SCX * SCY * SCZ];
+	float minz[SCX * SCY * SCZ];
+	uint8_t inside[SCX * SCY * SCZ];
+
+	// Chunks reached by the visibility walk, with the face they were entered through and
+	// the directions taken to get there
+	uint8_t visible[SCX * SCY * SCZ];
+	uint8_t entry[SCX * SCY * SCZ];
+	uint8_t dirs[SCX * SCY * SCZ];
+	int queue[SCX * SCY * SCZ];
+
+	// Culling statistics of the last frame
+	int tested;
+	int culled;
+	int occluded;
+	int drawn;
+	int drawnlod[LODLEVELS];
+	int blended;
+
+	// Chunks with water or glass in ring order, the same chunks from back to front as seen from the middle
+	// of the chunk the camera was in when they were sorted, and how often they had to be sorted
+	std::vector<chunk *> blending;
+	std::vector<chunk *> blendchunks;
+	std::vector<std::pair<float, int> > blendorder;
+	glm::ivec3 sortedfrom;
+	long resorts;
+
+	// Streaming statistics
+	long loaded;
+	long unloaded;
+
+	// Blocks whose light still has to be spread or taken away, in world coordinates
+	std::vector<lightnode> lightqueue;
+	std::vector<lightnode> darkqueue;
+
+	// Blocks that give off light and had it taken away while darkening
+	std::vector<glm::ivec3> emitters;
+
+	// Lighting statistics
+	long columnslit;
+	double columntime;
+	long relights;
+	double relighttime;
+	double worstrelight;
+	long lightwrites;
+
+	basicsuperchunk(int seed, const char *dir): seed(seed), regions(dir, seed) {
+
+		// Keep enough generation jobs queued to keep all the worker threads busy
+		generate_ahead = 2 * jobqueue.workers.size();
+
+		// Keep the same distance in blocks as the game's own chunk size would, as far as the grid allows
+		radius = std::max(1, std::min(view_radius * ::CX / CX, std::min(SCX, SCZ) / 2 - 1));
+
+		// Every chunk might need a VBO slot
+		slots.reserve(SCX * SCY * SCZ);
+
+		memset(c, 0, sizeof c);
+		cx = cz = 0;
+
+		tested = culled = occluded = drawn = blended = 0;
+		memset(drawnlod, 0, sizeof drawnlod);
+		sortedfrom = glm::ivec3(0, 0, 0);
+		resorts = 0;
+		loaded = unloaded = 0;
+		save_budget = 4;
+
+		columnslit = relights = lightwrites = 0;
+		columntime = relighttime = worstrelight = 0;
+	}
+
+	// Unload all chunks. There must be no jobs left for them.
+	~basicsuperchunk() {
+		for(int i = 0; i < SCX * SCY * SCZ; i++)
+			if((&c[0][0][0])[i])
+				unload((&c[0][0][0])[i]);
+
+		for(size_t i = 0; i < dead.size(); i++)
+			delete dead[i];
+	}
+
+	// Find the chunk with the given chunk coordinates, if it is loaded
+	chunk *find(int x, int y, int z) const {
+		if(y < -SCY / 2 || y >= SCY - SCY / 2)
+			return 0;
+
+		chunk *ch = c[floormod(x, SCX)][y + SCY / 2][floormod(z, SCZ)];
+
+		if(!ch || ch->ax != x || ch->az != z)
+			return 0;
+
+		return ch;
+	}
+
+	uint8_t get(int x, int y, int z) const {
+		chunk *ch = find(floordiv(x, CX), floordiv(y, CY), floordiv(z, CZ));
+
+		if(!ch)
+			return 0;
+
+		return ch->get(x & (CX - 1), y & (CY - 1), z & (CZ - 1));
+	}
+
+	void set(int x, int y, int z, uint8_t type) {
+		chunk *ch = find(floordiv(x, CX), floordiv(y, CY), floordiv(z, CZ));
+
+		if(!ch)
+			return;
+
+		ch->set(x & (CX - 1), y & (CY - 1), z & (CZ - 1), type);
+
+		std::vector<glm::ivec3> changed(1, glm::ivec3(x, y, z));
+		relight(changed);
+	}
+
+	// Change many blocks at once, for example for an explosion or a structure. The edits are grouped per chunk,
+	// so every chunk is looked up, changed and marked for remeshing only once. If the same block is changed
+	// more than once, the last edit wins. Edits of blocks in chunks that are not loaded are ignored.
+	void set(const std::vector<blockedit> &edits) {
+		// Sort the edits by chunk, keeping their order within every chunk
+		std::vector<std::pair<int, int> > order;
+		order.reserve(edits.size());
+
+		for(size_t i = 0; i < edits.size(); i++) {
+			int x = floordiv(edits[i].x, CX);
+			int y = floordiv(edits[i].y, CY);
+			int z = floordiv(edits[i].z, CZ);
+
+			if(find(x, y, z))
+				order.push_back(std::make_pair((floormod(x, SCX) * SCY + y + SCY / 2) * SCZ + floormod(z, SCZ), (int)i));
+		}
+
+		std::sort(order.begin(), order.end());
+
+		std::vector<blockedit> local;
+		std::vector<glm::ivec3> changed;
+		changed.reserve(order.size());
+
+		for(size_t i = 0; i < order.size();) {
+			int chunkindex = order[i].first;
+			local.clear();
+
+			for(; i < order.size() && order[i].first == chunkindex; i++) {
+				blockedit e = edits[order[i].second];
+				changed.push_back(glm::ivec3(e.x, e.y, e.z));
+				e.x &= CX - 1;
+				e.y &= CY - 1;
+				e.z &= CZ - 1;
+				local.push_back(e);
+			}
+
+			(&c[0][0][0])[chunkindex]->set(local.data(), local.size());
+		}
+
+		relight(changed);
+	}
+
+	// Set all blocks with x0 <= x <= x1, y0 <= y <= y1 and z0 <= z <= z1 to the same type, one chunk at a time.
+	// Chunks that are completely inside the box are filled without looking at their blocks.
+	void fill(int x0, int y0, int z0, int x1, int y1, int z1, uint8_t type) {
+		std::vector<blockedit> local;
+		std::vector<glm::ivec3> changed;
+
+		for(int cx = floordiv(x0, CX); cx <= floordiv(x1, CX); cx++) {
+			for(int cy = floordiv(y0, CY); cy <= floordiv(y1, CY); cy++) {
+				for(int cz = floordiv(z0, CZ); cz <= floordiv(z1, CZ); cz++) {
+					chunk *ch = find(cx, cy, cz);
+					if(!ch)
+						continue;
+
+					bool whole = x0 <= cx * CX && x1 >= cx * CX + CX - 1 && y0 <= cy * CY && y1 >= cy * CY + CY - 1 && z0 <= cz * CZ && z1 >= cz * CZ + CZ - 1;
+
+					local.clear();
+					for(int x = std::max(x0, cx * CX); x <= std::min(x1, cx * CX + CX - 1); x++) {
+						for(int y = std::max(y0, cy * CY); y <= std::min(y1, cy * CY + CY - 1); y++) {
+							for(int z = std::max(z0, cz * CZ); z <= std::min(z1, cz * CZ + CZ - 1); z++) {
+								if(ch->lit)
+									changed.push_back(glm::ivec3(x, y, z));
+								if(whole)
+									continue;
+								blockedit e = {x & (CX - 1), y & (CY - 1), z & (CZ - 1), type};
+								local.push_back(e);
+							}
+						}
+					}
+
+					if(whole)
+						ch->fill(type);
+					else
+						ch->set(local.data(), local.size());
+				}
+			}
+		}
+
+		relight(changed);
+	}
+
+	// The chunk with block (x, y, z) in it, if it is loaded and its light is known
+	chunk *lightchunk(int x, int y, int z) const {
+		chunk *ch = find(floordiv(x, CX), floordiv(y, CY), floordiv(z, CZ));
+
+		if(!ch || !ch->lit)
+			return 0;
+
+		return ch;
+	}
+
+	// Spread the light of the blocks in the light queue to their neighbours, until nothing brightens anymore.
+	// Light loses one level per block, except for sky light going straight down through air or glass.
+	// Opaque blocks never get light, but those that give off light do spread it.
+	void spread() {
+		for(size_t head = 0; head < lightqueue.size(); head++) {
+			lightnode p = lightqueue[head];
+			chunk *pc = lightchunk(p.x, p.y, p.z);
+			if(!pc)
+				continue;
+
+			uint8_t l = pc->getlight(p.x & (CX - 1), p.y & (CY - 1), p.z & (CZ - 1));
+			int sky = l >> 4;
+			int blk = l & 15;
+
+			if(sky <= 1 && blk <= 1)
+				continue;
+
+			for(int f = 0; f < 6; f++) {
+				const struct facedir &fd = facedirs[f];
+				int x = p.x + fd.n[0];
+				int y = p.y + fd.n[1];
+				int z = p.z + fd.n[2];
+
+				chunk *ch = lightchunk(x, y, z);
+				if(!ch)
+					continue;
+
+				int lx = x & (CX - 1);
+				int ly = y & (CY - 1);
+				int lz = z & (CZ - 1);
+				uint8_t b = ch->get(lx, ly, lz);
+				if(!transparent[b])
+					continue;
+
+				int tosky = f == 2 && sky == 15 && skythrough(b) ? 15 : sky - 1;
+				int toblk = blk - 1;
+				uint8_t old = ch->getlight(lx, ly, lz);
+				int newsky = std::max(old >> 4, tosky);
+				int newblk = std::max(old & 15, toblk);
+
+				if(newsky == old >> 4 && newblk == (old & 15))
+					continue;
+
+				ch->setlight(lx, ly, lz, newsky << 4 | newblk);
+				lightwrites++;
+
+				lightnode n = {x, y, z, 0};
+				lightqueue.push_back(n);
+			}
+		}
+
+		lightqueue.clear();
+	}
+
+	// Take away the light that came from the blocks in the dark queue, in the sky (shift 4) or block light (shift 0)
+	// channel. Neighbours that are at least as bright as where the darkness comes from must have gotten their light
+	// elsewhere, and are queued to spread it back in.
+	void darken(int shift) {
+		for(size_t head = 0; head < darkqueue.size(); head++) {
+			lightnode p = darkqueue[head];
+
+			for(int f = 0; f < 6; f++) {
+				const struct facedir &fd = facedirs[f];
+				int x = p.x + fd.n[0];
+				int y = p.y + fd.n[1];
+				int z = p.z + fd.n[2];
+
+				chunk *ch = lightchunk(x, y, z);
+				if(!ch)
+					continue;
+
+				int lx = x & (CX - 1);
+				int ly = y & (CY - 1);
+				int lz = z & (CZ - 1);
+				uint8_t old = ch->getlight(lx, ly, lz);
+				int level = old >> shift & 15;
+
+				if(!level)
+					continue;
+
+				if(level < p.level || (shift == 4 && f == 2 && p.level == 15 && level == 15)) {
+					ch->setlight(lx, ly, lz, old & ~(15 << shift));
+					lightwrites++;
+
+					if(!shift && emission[ch->get(lx, ly, lz)])
+						emitters.push_back(glm::ivec3(x, y, z));
+
+					lightnode n = {x, y, z, (uint8_t)level};
+					darkqueue.push_back(n);
+				} else {
+					lightnode n = {x, y, z, 0};
+					lightqueue.push_back(n);
+				}
+			}
+		}
+
+		darkqueue.clear();
+	}
+
+	// Bring the light up to date after the given blocks changed. First the light that may have come through them
+	// is taken away, then the light from all around is spread back in. Only blocks whose light can have changed
+	// are visited, so small edits stay cheap.
+	void relight(const std::vector<glm::ivec3> &changed) {
+		if(changed.empty())
+			return;
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		int top = (SCY - SCY / 2) * CY - 1;
+
+		for(int shift = 4; shift >= 0; shift -= 4) {
+			for(size_t i = 0; i < changed.size(); i++) {
+				const glm::ivec3 &p = changed[i];
+				chunk *ch = lightchunk(p.x, p.y, p.z);
+				if(!ch)
+					continue;
+
+				int lx = p.x & (CX - 1);
+				int ly = p.y & (CY - 1);
+				int lz = p.z & (CZ - 1);
+				uint8_t old = ch->getlight(lx, ly, lz);
+				int level = old >> shift & 15;
+				if(!level)
+					continue;
+
+				ch->setlight(lx, ly, lz, old & ~(15 << shift));
+				lightnode n = {p.x, p.y, p.z, (uint8_t)level};
+				darkqueue.push_back(n);
+			}
+
+			darken(shift);
+		}
+
+		for(size_t i = 0; i < changed.size(); i++) {
+			const glm::ivec3 &p = changed[i];
+			chunk *ch = lightchunk(p.x, p.y, p.z);
+			if(!ch)
+				continue;
+
+			uint8_t b = ch->get(p.x & (CX - 1), p.y & (CY - 1), p.z & (CZ - 1));
+
+			if(emission[b])
+				emitters.push_back(p);
+
+			// Nothing is above the top of the world but sky
+			if(p.y == top && skythrough(b))
+				ch->setlight(p.x & (CX - 1), p.y & (CY - 1), p.z & (CZ - 1), 0xf0 | (ch->getlight(p.x & (CX - 1), p.y & (CY - 1), p.z & (CZ - 1)) & 15));
+
+			for(int f = -1; f < 6; f++) {
+				lightnode n = {p.x, p.y, p.z, 0};
+				if(f >= 0) {
+					n.x += facedirs[f].n[0];
+					n.y += facedirs[f].n[1];
+					n.z += facedirs[f].n[2];
+				}
+				lightqueue.push_back(n);
+			}
+		}
+
+		// Blocks that give off light get it back, whatever took it away
+		for(size_t i = 0; i < emitters.size(); i++) {
+			const glm::ivec3 &p = emitters[i];
+			chunk *ch = lightchunk(p.x, p.y, p.z);
+			int lx = p.x & (CX - 1);
+			int ly = p.y & (CY - 1);
+			int lz = p.z & (CZ - 1);
+			int e = emission[ch->get(lx, ly, lz)];
+			uint8_t old = ch->getlight(lx, ly, lz);
+
+			if((old & 15) < e)
+				ch->setlight(lx, ly, lz, (old & 0xf0) | e);
+
+			lightnode n = {p.x, p.y, p.z, 0};
+			lightqueue.push_back(n);
+		}
+
+		emitters.clear();
+		spread();
+
+		double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		relights++;
+		relighttime += t;
+		worstrelight = std::max(worstrelight, t);
+	}
+
+	// Have up to n of the columns of chunks that are completely generated but not lit yet lit on the worker threads,
+	// closest to the camera first
+	void lightcolumns(int n) {
+		std::vector<std::pair<int, int> > columns;
+
+		for(int x = 0; x < SCX; x++) {
+			for(int z = 0; z < SCZ; z++) {
+				bool complete = true;
+				for(int y = 0; y < SCY; y++)
+					if(!c[x][y][z] || !c[x][y][z]->noised || c[x][y][z]->lit || c[x][y][z]->lighting)
+						complete = false;
+
+				if(!complete)
+					continue;
+
+				int dx = c[x][0][z]->ax - cx;
+				int dz = c[x][0][z]->az - cz;
+				columns.push_back(std::make_pair(dx * dx + dz * dz, x * SCZ + z));
+			}
+		}
+
+		n = std::max(0, std::min(n, (int)columns.size()));
+		std::partial_sort(columns.begin(), columns.begin() + n, columns.end());
+
+		for(int i = 0; i < n; i++) {
+			int x = columns[i].second / SCZ;
+			int z = columns[i].second % SCZ;
+			chunk *column[SCY];
+			for(int y = 0; y < SCY; y++)
+				column[y] = c[x][y][z];
+
+			jobqueue.push(new lightjob<CX, CY, CZ, SCX, SCY, SCZ>(this, column, sqrtf(columns[i].first) * CX));
+		}
+	}
+
+	// Follow a ray from origin in direction dir, and find the first block that is not air within maxdistance blocks.
+	// Every block the ray passes through is visited exactly once, in order, by stepping to whichever block
+	// boundary along the x, y or z axis comes first (Amanatides and Woo).
+	bool raycast(const glm::vec3 &origin, const glm::vec3 &dir, float maxdistance, raycasthit &hit) const {
+		float length = glm::length(dir);
+		glm::vec3 d = length > 0 ? dir / length : dir;
+		int p[3] = {(int)floorf(origin.x), (int)floorf(origin.y), (int)floorf(origin.z)};
+		int step[3];
+		float next[3];
+		float delta[3];
+
+		// Distance along the ray to the first block boundary, and between boundaries, for every axis
+		for(int a = 0; a < 3; a++) {
+			if(d[a] > 0) {
+				step[a] = 1;
+				delta[a] = 1 / d[a];
+				next[a] = (p[a] + 1 - origin[a]) * delta[a];
+			} else if(d[a] < 0) {
+				step[a] = -1;
+				delta[a] = -1 / d[a];
+				next[a] = (origin[a] - p[a]) * delta[a];
+			} else {
+				step[a] = 0;
+				delta[a] = INFINITY;
+				next[a] = INFINITY;
+			}
+		}
+
+		float t = 0;
+		int face = -1;
+
+		for(;;) {
+			int lo[3] = {p[0], p[1], p[2]};
+			int hi[3] = {p[0] + 1, p[1] + 1, p[2] + 1};
+
+			if(skip_empty_space ? !emptyregion(p[0], p[1], p[2], lo, hi) : get(p[0], p[1], p[2])) {
+				hit.x = p[0];
+				hit.y = p[1];
+				hit.z = p[2];
+				hit.face = face;
+				hit.distance = t;
+				hit.type = get(p[0], p[1], p[2]);
+				return true;
+			}
+
+			// Inside an empty brick or chunk, go straight to where the ray leaves it
+			if(hi[0] - lo[0] > 1) {
+				float exit[3];
+				for(int a = 0; a < 3; a++)
+					exit[a] = step[a] > 0 ? (hi[a] - origin[a]) * delta[a] : step[a] < 0 ? (origin[a] - lo[a]) * delta[a] : INFINITY;
+
+				int a = exit[0] < exit[1] ? (exit[0] < exit[2] ? 0 : 2) : (exit[1] < exit[2] ? 1 : 2);
+				t = exit[a];
+				if(t > maxdistance)
+					return false;
+
+				// Find the block just outside, and the distances to its boundaries
+				for(int b = 0; b < 3; b++) {
+					if(b == a)
+						p[b] = step[b] > 0 ? hi[b] : lo[b] - 1;
+					else
+						p[b] = std::min(std::max((int)floorf(origin[b] + d[b] * t), lo[b]), hi[b] - 1);
+
+					if(step[b] > 0)
+						next[b] = (p[b] + 1 - origin[b]) * delta[b];
+					else if(step[b] < 0)
+						next[b] = (origin[b] - p[b]) * delta[b];
+				}
+
+				face = step[a] > 0 ? a + 3 : a;
+				continue;
+			}
+
+			int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+			t = next[a];
+			if(t > maxdistance)
+				return false;
+
+			p[a] += step[a];
+			next[a] += delta[a];
+
+			// Moving in the positive direction, the ray enters the next block through its negative face
+			face = step[a] > 0 ? a + 3 : a;
+		}
+	}
+
+	// Find the largest region known to hold only air around block (x, y, z), from the occupancy counts: the whole
+	// chunk if it is empty or not loaded, otherwise the brick if that is empty, otherwise only the block itself.
+	// The region is lo <= p < hi on every axis. Returns false if the block is not air.
+	bool emptyregion(int x, int y, int z, int lo[3], int hi[3]) const {
+		int cx = floordiv(x, CX);
+		int cy = floordiv(y, CY);
+		int cz = floordiv(z, CZ);
+		int size[3] = {CX, CY, CZ};
+		chunk *ch = find(cx, cy, cz);
+
+		if(!ch || ch->empty()) {
+			lo[0] = cx * CX;
+			lo[1] = cy * CY;
+			lo[2] = cz * CZ;
+		} else if(ch->brickempty(x & (CX - 1), y & (CY - 1), z & (CZ - 1))) {
+			lo[0] = x & ~3;
+			lo[1] = y & ~3;
+			lo[2] = z & ~3;
+			size[0] = size[1] = size[2] = 4;
+		} else {
+			lo[0] = x;
+			lo[1] = y;
+			lo[2] = z;
+			size[0] = size[1] = size[2] = 1;
+			if(ch->get(x & (CX - 1), y & (CY - 1), z & (CZ - 1)))
+				return false;
+		}
+
+		for(int a = 0; a < 3; a++)
+			hi[a] = lo[a] + size[a];
+		return true;
+	}
+
+	// Whether all blocks with x0 <= x <= x1, y0 <= y <= y1 and z0 <= z <= z1 are air, for example to see if there is
+	// room for something. Empty chunks and bricks are passed over without looking at their blocks.
+	bool isempty(int x0, int y0, int z0, int x1, int y1, int z1) const {
+		for(int cx = floordiv(x0, CX); cx <= floordiv(x1, CX); cx++) {
+			for(int cy = floordiv(y0, CY); cy <= floordiv(y1, CY); cy++) {
+				for(int cz = floordiv(z0, CZ); cz <= floordiv(z1, CZ); cz++) {
+					chunk *ch = find(cx, cy, cz);
+					if(!ch || ch->empty())
+						continue;
+
+					// The part of the box inside this chunk
+					int lo[3] = {std::max(x0 - cx * CX, 0), std::max(y0 - cy * CY, 0), std::max(z0 - cz * CZ, 0)};
+					int hi[3] = {std::min(x1 - cx * CX, CX - 1), std::min(y1 - cy * CY, CY - 1), std::min(z1 - cz * CZ, CZ - 1)};
+
+					for(int bx = lo[0] >> 2; bx <= hi[0] >> 2; bx++) {
+						for(int by = lo[1] >> 2; by <= hi[1] >> 2; by++) {
+							for(int bz = lo[2] >> 2; bz <= hi[2] >> 2; bz++) {
+								if(!ch->bricks[bx][by][bz])
+									continue;
+
+								for(int x = std::max(lo[0], bx * 4); x <= std::min(hi[0], bx * 4 + 3); x++)
+									for(int y = std::max(lo[1], by * 4); y <= std::min(hi[1], by * 4 + 3); y++)
+										for(int z = std::max(lo[2], bz * 4); z <= std::min(hi[2], bz * 4 + 3); z++)
+											if(ch->get(x, y, z))
+												return false;
+							}
+						}
+					}
+				}
+			}
+		}
+
+		return true;
+	}
+
+	// Whether nothing but air is between a and b
+	bool lineofsight(const glm::vec3 &a, const glm::vec3 &b) const {
+		raycasthit hit;
+		return !raycast(a, b - a, glm::length(b - a), hit);
+	}
+
+	// Create an empty chunk and link it to the neighbours that are already loaded
+	void load(int x, int y, int z) {
+		int i = (floormod(x, SCX) * SCY + y + SCY / 2) * SCZ + floormod(z, SCZ);
+		chunk *ch = new chunk(x, y, z);
+
+		(&c[0][0][0])[i] = ch;
+		minx[i] = x * CX;
+		miny[i] = y * CY;
+		minz[i] = z * CZ;
+
+		if((ch->left = find(x - 1, y, z)))
+			ch->left->right = ch;
+		if((ch->right = find(x + 1, y, z)))
+			ch->right->left = ch;
+		if((ch->below = find(x, y - 1, z)))
+			ch->below->above = ch;
+		if((ch->above = find(x, y + 1, z)))
+			ch->above->below = ch;
+		if((ch->front = find(x, y, z - 1)))
+			ch->front->back = ch;
+		if((ch->back = find(x, y, z + 1)))
+			ch->back->front = ch;
+
+		loaded++;
+	}
+
+	// Remove a chunk from the grid. If a worker thread is still busy with it, it is deleted once its job is finished.
+	void unload(chunk *&ch) {
+		save(ch);
+		ch->unload();
+
+		if(ch->generating || ch->meshing || ch->lighting)
+			dead.push_back(ch);
+		else
+			delete ch;
+
+		ch = 0;
+		unloaded++;
+	}
+
+	// Write a chunk back to its region file, if its blocks changed since it was loaded
+	void save(chunk *ch) {
+		if(!ch->dirty || !ch->noised)
+			return;
+
+		uint8_t blk[CX][CY][CZ];
+		ch->blocks.unpack(&blk[0][0][0]);
+		regions.save(ch->ax, ch->ay, ch->az, blk);
+		ch->dirty = false;
+	}
+
+	// Write back all changed chunks, for example before exiting
+	void save() {
+		for(int i = 0; i < SCX * SCY * SCZ; i++)
+			if((&c[0][0][0])[i])
+				save((&c[0][0][0])[i]);
+	}
+
+	// Make sure exactly the chunks within radius of the camera are loaded
+	void stream(const glm::vec3 &camera) {
+		int oldcx = cx;
+		int oldcz = cz;
+
+		cx = floordiv((int)floorf(camera.x), CX);
+		cz = floordiv((int)floorf(camera.z), CZ);
+
+		if(cx != oldcx || cz != oldcz)
+			regions.trim(cx, cz);
+
+		for(int x = cx - SCX / 2; x < cx + SCX - SCX / 2; x++) {
+			for(int z = cz - SCZ / 2; z < cz + SCZ - SCZ / 2; z++) {
+				bool wanted = (x - cx) * (x - cx) + (z - cz) * (z - cz) <= radius * radius;
+
+				for(int y = 0; y < SCY; y++) {
+					chunk *&ch = c[floormod(x, SCX)][y][floormod(z, SCZ)];
+
+					if(ch && (!wanted || ch->ax != x || ch->az != z))
+						unload(ch);
+
+					if(!ch && wanted)
+						load(x, y - SCY / 2, z);
+				}
+			}
+		}
+
+		// Free the unloaded chunks that the worker threads are done with
+		for(size_t i = 0; i < dead.size();) {
+			if(dead[i]->generating || dead[i]->meshing || dead[i]->lighting) {
+				i++;
+				continue;
+			}
+
+			delete dead[i];
+			dead[i] = dead.back();
+			dead.pop_back();
+		}
+
+		// Write back a few of the chunks that changed, so edits are not lost if we exit
+		int budget = save_budget;
+		for(int i = 0; i < SCX * SCY * SCZ && budget; i++) {
+			chunk *ch = (&c[0][0][0])[i];
+			if(ch && ch->dirty && ch->noised) {
+				save(ch);
+				budget--;
+			}
+		}
+	}
+
+	// Force all chunks to be meshed again, for example after changing the meshing mode
+	void remesh() {
+		for(int x = 0; x < SCX; x++)
+			for(int y = 0; y < SCY; y++)
+				for(int z = 0; z < SCZ; z++)
+					if(c[x][y][z])
+						c[x][y][z]->changed = true;
+	}
+
+	void print_stats() {
+		int chunks = 0;
+		long quads = 0;
+		long merged = 0;
+		long vertices = 0;
+		long padding = 0;
+		int stored = 0;
+		int bybits[9] = {};
+		long bytes = 0;
+		long lightbytes = 0;
+
+		for(int x = 0; x < SCX; x++)
+			for(int y = 0; y < SCY; y++)
+				for(int z = 0; z < SCZ; z++) {
+					chunk *ch = c[x][y][z];
+					if(!ch)
+						continue;
+					stored++;
+					bybits[ch->blocks.bits]++;
+					bytes += ch->blocks.bytes();
+					lightbytes += ch->skylight.bytes() + ch->lamplight.bytes();
+					if(!ch->initialized)
+						continue;
+					chunks++;
+					quads += ch->quads;
+					merged += ch->merged;
+					vertices += ch->elements;
+					for(int k = 0; k < MESHSECTIONS; k++)
+						padding += ch->section[k].room - ch->section[k].count;
+				}
+
+		fprintf(stderr, "%d chunks meshed: %ld quads emitted, %ld faces merged away, %ld vertices (%ld bytes), %ld of them room for sections to grow\n", chunks, quads, merged, vertices, vertices * (long)sizeof(byte4), padding);
+		fprintf(stderr, "Meshes: %ld made whole, %ld patched one section at a time\n", meshed, patched);
+		if(stored)
+			fprintf(stderr, "Block storage: %d chunks, %d uniform, %d with 1, %d with 2, %d with 4 bits per block, %d uncompressed, %ld bytes (%ld per chunk instead of %d)\n", stored, bybits[0], bybits[1], bybits[2], bybits[4], bybits[8], bytes, bytes / stored, CX * CY * CZ);
+		if(stored)
+			fprintf(stderr, "Light storage: %ld bytes (%ld per chunk instead of %d)\n", lightbytes, lightbytes / stored, CX * CY * CZ);
+		fprintf(stderr, "Last frame: %d chunks tested, %d outside the frustum, %d occluded, %d drawn\n", tested, culled, occluded, drawn);
+		fprintf(stderr, "Water and glass: %zu chunks have some, %d drawn blended last frame, sorted %ld times\n", blendchunks.size(), blended, resorts);
+		fprintf(stderr, "Level of detail: %d chunks drawn with all blocks", drawnlod[0]);
+		for(int i = 1; i < LODLEVELS; i++)
+			fprintf(stderr, ", %d merging cubes of %d blocks", drawnlod[i], 1 << (3 * i));
+		fprintf(stderr, "\n");
+		fprintf(stderr, "%d of %d VBO slots used (peak %d), %ld allocations, %ld evictions\n", slots.used, (int)slots.owner.size(), slots.peak, slots.allocations, slots.evictions);
+		if(quadindices.quads)
+			fprintf(stderr, "Quad index buffer: %d quads (%ld bytes)\n", quadindices.quads, quadindices.quads * 6L * (long)sizeof(GLuint));
+		if(arena.capacity)
+			fprintf(stderr, "Vertex arena: %d of %d vertices used, %zu free ranges, largest free range %d vertices, grown %ld times\n", arena.used, arena.capacity, arena.freeranges.size(), arena.largest_free(), arena.grows);
+		fprintf(stderr, "Region files: %zu open, %ld chunks read, %ld chunks written (%ld bytes)\n", regions.files.size(), regions.reads, regions.writes, regions.written);
+		if(columnslit)
+			fprintf(stderr, "Lighting: %ld columns lit (%.3f ms each on the worker threads)", columnslit, columntime * 1e3 / columnslit);
+		if(relights)
+			fprintf(stderr, ", %ld updates after edits (%.3f ms each, worst %.3f ms)", relights, relighttime * 1e3 / relights, worstrelight * 1e3);
+		if(columnslit)
+			fprintf(stderr, ", %ld light values changed by spreading\n", lightwrites);
+		fprintf(stderr, "Streaming: %ld chunks loaded, %ld unloaded, %zu unloaded chunks waiting for their jobs\n", loaded, unloaded, dead.size());
+		fprintf(stderr, "%zu jobs waiting to be run or finished, %d chunks being generated\n", jobqueue.queued(), generating);
+	}
+
+	void render(const glm::mat4 &pv, const glm::vec3 &camera) {
+		// Upload the meshes that the mesher threads have finished, but not too many per frame
+		jobqueue.finish(upload_budget);
+
+		// Load the chunks that came within range, and drop those that went out of it
+		stream(camera);
+
+		// Keep a few of the columns of chunks that were generated completely being lit
+		lightcolumns(generate_ahead - lighting);
+
+		// Find out which chunks are inside the view frustum, all at once
+		frustum f;
+		f.extract(pv);
+		f.cull(minx, miny, minz, SCX * SCY * SCZ, CX, CY, CZ, inside);
+
+		for(int i = 0; i < SCX * SCY * SCZ; i++)
+			if(!(&c[0][0][0])[i])
+				inside[i] = 0;
+
+		// Then find out which of those can be seen through open space from the camera
+		if(occlusion_culling)
+			walk(camera);
+		else
+			memcpy(visible, inside, sizeof visible);
+
+		tested = 0;
+		culled = 0;
+		occluded = 0;
+		drawn = 0;
+		memset(drawnlod, 0, sizeof drawnlod);
+		blended = 0;
+		blending.clear();
+
+		// Visible chunks that are not generated yet, and how far away they are
+		std::vector<std::pair<float, chunk *> > wanted;
+
+		for(int i = 0; i < SCX * SCY * SCZ; i++) {
+			chunk *ch = (&c[0][0][0])[i];
+			if(!ch)
+				continue;
+
+			tested++;
+
+			if(ch->blends())
+				blending.push_back(ch);
+
+			// If it is outside the screen, don't bother drawing it
+			if(!inside[i]) {
+				culled++;
+				continue;
+			}
+
+			// If it is hidden behind other chunks, don't draw it either
+			if(!visible[i]) {
+				occluded++;
+				continue;
+			}
+
+			glm::vec3 center = glm::vec3(minx[i] + CX / 2, miny[i] + CY / 2, minz[i] + CZ / 2);
+			float d = glm::length(center - camera);
+			ch->distance = d;
+
+			// The further away, the less detail
+			int lod = lodlevel(d, ch->lod);
+			if(lod != ch->lod)
+				ch->setlod(lod);
+
+			// If this chunk is not initialized, skip it
+			if(!ch->initialized) {
+				if(ch->ready()) {
+					ch->initialized = true;
+				} else {
+					// But remember it so it gets generated
+					wanted.push_back(std::make_pair(d, ch));
+					continue;
+				}
+			}
+
+			glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(minx[i], miny[i], minz[i]));
+			ch->render(pv * model);
+
+			if(ch->elements) {
+				drawn++;
+				drawnlod[ch->lod]++;
+			}
+		}
+
+		arena.flush(pv, meshformat());
+
+		renderblended(pv, camera);
+
+		// Generate the missing chunks closest to the camera first. Only keep a few jobs in flight,
+		// so the order still follows the camera when it moves.
+		std::sort(wanted.begin(), wanted.end());
+
+		for(size_t i = 0; i < wanted.size() && generating < generate_ahead; i++) {
+			chunk *ch = wanted[i].second;
+			float d = wanted[i].first;
+
+			// Chunks are lit a whole column at a time, so generate the whole columns around this one
+			generatecolumn(ch, d);
+			generatecolumn(ch->left, d);
+			generatecolumn(ch->right, d);
+			generatecolumn(ch->front, d);
+			generatecolumn(ch->back, d);
+		}
+	}
+
+	// Draw the water and glass of all visible chunks on top of everything else, from back to front, so they blend
+	// with what is behind them. Chunks are only sorted again when the camera moves into another chunk, or when
+	// chunks gain or lose water or glass. Faces within a chunk are not sorted.
+	void renderblended(const glm::mat4 &pv, const glm::vec3 &camera) {
+		glm::ivec3 from(floordiv((int)floorf(camera.x), CX), floordiv((int)floorf(camera.y), CY), floordiv((int)floorf(camera.z), CZ));
+
+		if(from != sortedfrom || blending != blendchunks) {
+			glm::vec3 middle = glm::vec3(from.x * CX + CX / 2, from.y * CY + CY / 2, from.z * CZ + CZ / 2);
+
+			blendorder.clear();
+			for(size_t j = 0; j < blending.size(); j++) {
+				chunk *ch = blending[j];
+				glm::vec3 center = glm::vec3(ch->ax * CX + CX / 2, ch->ay * CY + CY / 2, ch->az * CZ + CZ / 2);
+				int i = (floormod(ch->ax, SCX) * SCY + ch->ay + SCY / 2) * SCZ + floormod(ch->az, SCZ);
+				blendorder.push_back(std::make_pair(-glm::length(center - middle), i));
+			}
+
+			std::sort(blendorder.begin(), blendorder.end());
+			blendchunks = blending;
+			sortedfrom = from;
+			resorts++;
+		}
+
+		if(blendorder.empty())
+			return;
+
+		glEnable(GL_BLEND);
+		glDepthMask(GL_FALSE);
+		glUniform1f(uniform_cutoff, 0.05);
+
+		for(size_t j = 0; j < blendorder.size(); j++) {
+			int i = blendorder[j].second;
+			chunk *ch = (&c[0][0][0])[i];
+			if(!inside[i] || !visible[i] || !ch->initialized)
+				continue;
+
+			glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(minx[i], miny[i], minz[i]));
+			ch->renderblended(pv * model);
+			blended++;
+		}
+
+		arena.flush(pv, meshformat());
+
+		glUniform1f(uniform_cutoff, 0.4);
+		glDepthMask(GL_TRUE);
+		glDisable(GL_BLEND);
+	}
+
+	// Level of detail for a chunk at distance d from the camera, that has level current now. A chunk only switches
+	// once it is half a chunk past the edge of a ring, so it does not switch back and forth at the edge.
+	int lodlevel(float d, int current) const {
+		if(!lod_meshing)
+			return 0;
+
+		int nearer = lodring(d - CX / 2);
+		int further = lodring(d + CX / 2);
+
+		if(current >= nearer && current <= further)
+			return current;
+
+		return lodring(d);
+	}
+
+	// Index in c of the chunk at position (x, y, z) relative to the lowest corner of the grid
+	int ringindex(int x, int y, int z) const {
+		return (floormod(cx - SCX / 2 + x, SCX) * SCY + y) * SCZ + floormod(cz - SCZ / 2 + z, SCZ);
+	}
+
+	// Mark a chunk as reached by the visibility walk, if it is inside the frustum
+	void reach(int x, int y, int z, int from, int taken, int &n) {
+		int i = ringindex(x, y, z);
+
+		if(visible[i] || !inside[i])
+			return;
+
+		visible[i] = 1;
+		entry[i] = from;
+		dirs[i] = taken;
+		queue[n++] = (x * SCY + y) * SCZ + z;
+	}
+
+	// Breadth first walk over the chunks, starting at the camera. Positions are relative to the grid, which is
+	// centred on the camera. A chunk is only entered if the chunk it
+	// is entered from has open space between the two faces involved, and the walk never turns back towards
+	// the camera. Ungenerated chunks are treated as open, so the chunks behind them still get generated.
+	void walk(const glm::vec3 &camera) {
+		int dim[3] = {SCX, SCY, SCZ};
+		int cam[3] = {
+			SCX / 2,
+			(int)floorf(camera.y / CY) + SCY / 2,
+			SCZ / 2,
+		};
+		int head = 0;
+		int n = 0;
+
+		memset(visible, 0, sizeof visible);
+
+		bool outside = false;
+		for(int a = 0; a < 3; a++)
+			if(cam[a] < 0 || cam[a] >= dim[a])
+				outside = true;
+
+		if(!outside) {
+			// Always start at the camera, even if its own chunk lies just behind the near plane
+			int i = ringindex(cam[0], cam[1], cam[2]);
+			visible[i] = 1;
+			entry[i] = 0xff;
+			dirs[i] = 0;
+			queue[n++] = (cam[0] * SCY + cam[1]) * SCZ + cam[2];
+		} else {
+			// From outside the world, everything on the sides facing the camera can be seen
+			for(int f = 0; f < 6; f++) {
+				const struct facedir &fd = facedirs[f];
+				int layer = fd.n[fd.d] < 0 ? 0 : dim[fd.d] - 1;
+
+				if(fd.n[fd.d] < 0 ? cam[fd.d] >= 0 : cam[fd.d] < dim[fd.d])
+					continue;
+
+				for(int u = 0; u < dim[fd.u]; u++) {
+					for(int v = 0; v < dim[fd.v]; v++) {
+						int p[3];
+						p[fd.d] = layer;
+						p[fd.u] = u;
+						p[fd.v] = v;
+						reach(p[0], p[1], p[2], f, 0, n);
+					}
+				}
+			}
+		}
+
+		while(head < n) {
+			int p[3] = {queue[head] / (SCY * SCZ), queue[head] / SCZ % SCY, queue[head] % SCZ};
+			int i = ringindex(p[0], p[1], p[2]);
+			chunk *ch = (&c[0][0][0])[i];
+			head++;
+
+			for(int f = 0; f < 6; f++) {
+				const struct facedir &fd = facedirs[f];
+
+				// Never go back in a direction opposite to one already taken
+				if(dirs[i] & (1 << (f ^ 1)))
+					continue;
+
+				// Can we get from the face we came in through to this one?
+				if(entry[i] != 0xff && !(ch->connects[entry[i]] & (1 << f)))
+					continue;
+
+				int q[3] = {p[0] + fd.n[0], p[1] + fd.n[1], p[2] + fd.n[2]};
+				if(q[fd.d] < 0 || q[fd.d] >= dim[fd.d])
+					continue;
+
+				reach(q[0], q[1], q[2], f ^ 1, dirs[i] | (1 << f), n);
+			}
+		}
+	}
+
+	// Queue a chunk for terrain generation, unless it already is or has been generated
+	void generate(chunk *ch, float priority) {
+		if(!ch || ch->noised || ch->generating)
+			return;
+
+		// If this chunk was saved before, use that instead
+		uint8_t blk[CX][CY][CZ];
+		if(regions.load(ch->ax, ch->ay, ch->az, blk)) {
+			ch->install(blk);
+			return;
+		}
+
+		jobqueue.push(new genjob<CX, CY, CZ>(ch, seed, priority));
+	}
+
+	// Queue all chunks in the same column as ch for terrain generation
+	void generatecolumn(chunk *ch, float priority) {
+		if(!ch)
+			return;
+
+		for(int y = 0; y < SCY; y++)
+			generate(find(ch->ax, y - SCY / 2, ch->az), priority);
+	}
+};
+
+// Sky light comes straight down until it hits something that is not air or glass, and is then spread sideways and
+// further down together with the light of the blocks that give it off, following the same rules as
+// basicsuperchunk::spread().
+template<int CX, int CY, int CZ, int SCX, int SCY, int SCZ> void lightjob<CX, CY, CZ, SCX, SCY, SCZ>::run() {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	const int height = SCY * CY;
+	int top[CX][CZ];
+	std::vector<lightnode> queue;
+
+	memset(sky, 0, sizeof sky);
+	memset(lamp, 0, sizeof lamp);
+
+	// Find the lowest block of every column that the sky shines on directly
+	for(int x = 0; x < CX; x++) {
+		for(int z = 0; z < CZ; z++) {
+			int y = height;
+			while(y > 0 && skythrough(at(blk, x, y - 1, z)))
+				y--;
+			top[x][z] = y;
+
+			for(int i = y; i < height; i++)
+				at(sky, x, i, z) = 15;
+		}
+	}
+
+	// Only spread sky light from where it can go somewhere the sky does not shine on directly
+	for(int x = 0; x < CX; x++) {
+		for(int z = 0; z < CZ; z++) {
+			int highest = top[x][z] + 1;
+			for(int f = 0; f < 6; f++) {
+				int nx = x + facedirs[f].n[0];
+				int nz = z + facedirs[f].n[2];
+				if(!facedirs[f].n[1] && nx >= 0 && nx < CX && nz >= 0 && nz < CZ)
+					highest = std::max(highest, top[nx][nz]);
+			}
+
+			for(int y = top[x][z]; y < highest && y < height; y++) {
+				lightnode n = {x, y, z, 0};
+				queue.push_back(n);
+			}
+		}
+	}
+
+	// Blocks that give off light
+	for(int y = 0; y < SCY; y++) {
+		if(col[y]->empty())
+			continue;
+
+		for(int x = 0; x < CX; x++) {
+			for(int i = 0; i < CY; i++) {
+				for(int z = 0; z < CZ; z++) {
+					int e = emission[blk[y][x][i][z]];
+					if(!e)
+						continue;
+
+					lamp[y][x][i][z] = e;
+					lightnode n = {x, y * CY + i, z, 0};
+					queue.push_back(n);
+				}
+			}
+		}
+	}
+
+	for(size_t head = 0; head < queue.size(); head++) {
+		lightnode p = queue[head];
+		int fromsky = at(sky, p.x, p.y, p.z);
+		int fromlamp = at(lamp, p.x, p.y, p.z);
+
+		if(fromsky <= 1 && fromlamp <= 1)
+			continue;
+
+		for(int f = 0; f < 6; f++) {
+			const struct facedir &fd = facedirs[f];
+			int x = p.x + fd.n[0];
+			int y = p.y + fd.n[1];
+			int z = p.z + fd.n[2];
+
+			if(x < 0 || x >= CX || y < 0 || y >= height || z < 0 || z >= CZ)
+				continue;
+
+			uint8_t b = at(blk, x, y, z);
+			if(!transparent[b])
+				continue;
+
+			uint8_t &tosky = at(sky, x, y, z);
+			uint8_t &tolamp = at(lamp, x, y, z);
+			int newsky = std::max((int)tosky, f == 2 && fromsky == 15 && skythrough(b) ? 15 : fromsky - 1);
+			int newlamp = std::max((int)tolamp, fromlamp - 1);
+
+			if(newsky == tosky && newlamp == tolamp)
+				continue;
+
+			tosky = newsky;
+			tolamp = newlamp;
+			lightnode n = {x, y, z, 0};
+			queue.push_back(n);
+		}
+	}
+
+	time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template<int CX, int CY, int CZ, int SCX, int SCY, int SCZ> int lightjob<CX, CY, CZ, SCX, SCY, SCZ>::finish() {
+	lighting--;
+
+	bool usable = true;
+	for(int y = 0; y < SCY; y++) {
+		col[y]->lighting = false;
+		if(col[y]->dead || col[y]->lit)
+			usable = false;
+	}
 
-					uint8_t top = blk[x][y][z];
-					uint8_t bottom = blk[x][y][z];
-					uint8_t side = blk[x][y][z];
+	// If blocks of the column were changed in the meantime, it is lit again later
+	uint8_t now[CX][CY][CZ];
+	for(int y = 0; y < SCY && usable; y++) {
+		col[y]->blocks.unpack(&now[0][0][0]);
+		if(memcmp(now, blk[y], sizeof now))
+			usable = false;
+	}
+
+	if(!usable)
+		return 0;
+
+	for(int y = 0; y < SCY; y++) {
+		col[y]->skylight.pack(&sky[y][0][0][0]);
+		col[y]->lamplight.pack(&lamp[y][0][0][0]);
+		col[y]->lit = true;
+		col[y]->changed = true;
+	}
 
-					if(top == 3) {
-						bottom = 1;
-						side = 2;
-					} else if(top == 5) {
-						top = bottom = 12;
+	// Spread the light across the border with the neighbouring columns that were lit already, from whichever side
+	// is brighter than the other one can make it
+	for(int y = 0; y < SCY; y++) {
+		chunk *ch = col[y];
+		chunk *n[6] = {ch->left, ch->right, 0, 0, ch->front, ch->back};
+
+		for(int f = 0; f < 6; f++) {
+			if(!n[f])
+				continue;
+
+			// The faces along the side of the neighbour can be lit differently now
+			n[f]->changed = true;
+			if(!n[f]->lit)
+				continue;
+
+			const struct facedir &fd = facedirs[f];
+			for(int i = 0; i < (fd.n[0] ? CZ : CX); i++) {
+				for(int j = 0; j < CY; j++) {
+					int p[3] = {fd.n[0] ? (fd.n[0] < 0 ? 0 : CX - 1) : i, j, fd.n[2] ? (fd.n[2] < 0 ? 0 : CZ - 1) : i};
+					int q[3] = {p[0] + fd.n[0], j, p[2] + fd.n[2]};
+					uint8_t a = ch->getlight(p[0], p[1], p[2]);
+					uint8_t b = ch->getlight(q[0], q[1], q[2]);
+
+					if(transparent[ch->get(q[0], q[1], q[2])] && ((a >> 4) - 1 > (b >> 4) || (a & 15) - 1 > (b & 15))) {
+						lightnode l = {ch->ax * CX + p[0], ch->ay * CY + p[1], ch->az * CZ + p[2], 0};
+						w->lightqueue.push_back(l);
 					}
 
-					if(vis && z != 0 && blk[x][y][z] == blk[x][y][z - 1]) {
-						vertex[i - 4] = byte4(x + 1, y, z + 1, side);
-						vertex[i - 2] = byte4(x + 1, y + 1, z + 1, side);
-						vertex[i - 1] = byte4(x + 1, y, z + 1, side);
-						merged++;
-					} else {
-						vertex[i++] = byte4(x + 1, y, z, side);
-						vertex[i++] = byte4(x + 1, y + 1, z, side);
-						vertex[i++] = byte4(x + 1, y, z + 1, side);
-						vertex[i++] = byte4(x + 1, y + 1, z, side);
-						vertex[i++] = byte4(x + 1, y + 1, z + 1, side);
-						vertex[i++] = byte4(x + 1, y, z + 1, side);
+					if(transparent[ch->get(p[0], p[1], p[2])] && ((b >> 4) - 1 > (a >> 4) || (b & 15) - 1 > (a & 15))) {
+						lightnode l = {ch->ax * CX + q[0], ch->ay * CY + q[1], ch->az * CZ + q[2], 0};
+						w->lightqueue.push_back(l);
 					}
-					vis = true;
 				}
 			}
 		}
+	}
 
-		// View from negative y
+	w->spread();
 
-		for(int x = 0; x < CX; x++) {
-			for(int y = CY - 1; y >= 0; y--) {
-				for(int z = 0; z < CZ; z++) {
-					if(isblocked(x, y, z, x, y - 1, z)) {
-						vis = false;
-						continue;
-					}
+	w->columnslit++;
+	w->columntime += time;
+	return 0;
+}
 
-					uint8_t top = blk[x][y][z];
-					uint8_t bottom = blk[x][y][z];
+typedef basicsuperchunk<CX, CY, CZ, SCX, SCY, SCZ> superchunk;
 
-					if(top == 3) {
-						bottom = 1;
-					} else if(top == 5) {
-						top = bottom = 12;
-					}
+static superchunk *world;
 
-					if(vis && z != 0 && blk[x][y][z] == blk[x][y][z - 1]) {
-						vertex[i - 4] = byte4(x, y, z + 1, bottom + 128);
-						vertex[i - 2] = byte4(x + 1, y, z + 1, bottom + 128);
-						vertex[i - 1] = byte4(x, y, z + 1, bottom + 128);
-						merged++;
-					} else {
-						vertex[i++] = byte4(x, y, z, bottom + 128);
-						vertex[i++] = byte4(x + 1, y, z, bottom + 128);
-						vertex[i++] = byte4(x, y, z + 1, bottom + 128);
-						vertex[i++] = byte4(x + 1, y, z, bottom + 128);
-						vertex[i++] = byte4(x + 1, y, z + 1, bottom + 128);
-						vertex[i++] = byte4(x, y, z + 1, bottom + 128);
-					}
-					vis = true;
-				}
+// Far away terrain, beyond the chunks that are loaded. It is a height field sampled every HSTEP blocks from the same
+// land noise the chunks are generated from, without trees, caves or changes made by the player. It is made in tiles
+// of HTILE by HTILE blocks, in a grid of HTILES by HTILES tiles that moves along with the camera, so only the tiles
+// that come into range have to be made. Tiles are cached on disk, next to the region files.
+// All tiles share one vertex buffer, with a second buffer holding the position of every quad relative to the origin,
+// so the whole horizon is drawn with a single call. It is drawn before the chunks, and not within the radius they are
+// loaded in, so it cannot show above hills or through holes dug into them.
+static const int HTILE = 256;
+static const int HSTEP = 16;
+static const int HTILES = 8;
+static const int HSAMPLES = HTILE / HSTEP + 1;
+static const int HVERTICES = (HSAMPLES - 1) * (HSAMPLES - 1) * 6;
+
+// Height and block type of the top of the land at the corners of the quads of one tile
+struct horizontile {
+	int8_t height[HSAMPLES][HSAMPLES];
+	uint8_t type[HSAMPLES][HSAMPLES];
+};
+
+struct horizonlayer {
+	GLuint vbo;
+	GLuint offsetvbo;
+	const char *dir;
+	int seed;
+
+	// The tile in every slot of the grid, and whether its quads are uploaded
+	int tx[HTILES][HTILES];
+	int tz[HTILES][HTILES];
+	bool ready[HTILES][HTILES];
+
+	// Statistics
+	long generated;
+	long cached;
+
+	horizonlayer(int seed, const char *dir): dir(dir), seed(seed), generated(0), cached(0) {
+		// No tile is at INT_MIN, so every slot gets a tile on the first update
+		for(int x = 0; x < HTILES; x++) {
+			for(int z = 0; z < HTILES; z++) {
+				tx[x][z] = tz[x][z] = INT_MIN;
+				ready[x][z] = false;
 			}
 		}
 
-		// View from positive y
+		GLuint buffers[2];
+		glGenBuffers(2, buffers);
+		vbo = buffers[0];
+		offsetvbo = buffers[1];
 
-		for(int x = 0; x < CX; x++) {
-			for(int y = 0; y < CY; y++) {
-				for(int z = 0; z < CZ; z++) {
-					if(isblocked(x, y, z, x, y + 1, z)) {
-						vis = false;
-						continue;
-					}
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferData(GL_ARRAY_BUFFER, HTILES * HTILES * HVERTICES * sizeof(byte4), NULL, GL_STATIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, offsetvbo);
+		glBufferData(GL_ARRAY_BUFFER, HTILES * HTILES * HVERTICES * 4 * sizeof(GLshort), NULL, GL_STATIC_DRAW);
+
+		// Empty slots are drawn as degenerate triangles
+		std::vector<byte4> zero(HVERTICES, byte4(0, 0, 0, 0));
+		for(int i = 0; i < HTILES * HTILES; i++) {
+			glBindBuffer(GL_ARRAY_BUFFER, vbo);
+			glBufferSubData(GL_ARRAY_BUFFER, i * HVERTICES * sizeof(byte4), HVERTICES * sizeof(byte4), zero.data());
+		}
+	}
 
-					uint8_t top = blk[x][y][z];
-					uint8_t bottom = blk[x][y][z];
+	~horizonlayer() {
+		GLuint buffers[2] = {vbo, offsetvbo};
+		glDeleteBuffers(2, buffers);
+	}
 
-					if(top == 3) {
-						bottom = 1;
-					} else if(top == 5) {
-						top = bottom = 12;
-					}
+	void path(char *buf, size_t size, int x, int z) const {
+		snprintf(buf, size, "%s/h.%d.%d.%d", dir, seed, x, z);
+	}
 
-					if(vis && z != 0 && blk[x][y][z] == blk[x][y][z - 1]) {
-						vertex[i - 5] = byte4(x, y + 1, z + 1, top + 128);
-						vertex[i - 2] = byte4(x, y + 1, z + 1, top + 128);
-						vertex[i - 1] = byte4(x + 1, y + 1, z + 1, top + 128);
-						merged++;
-					} else {
-						vertex[i++] = byte4(x, y + 1, z, top + 128);
-						vertex[i++] = byte4(x, y + 1, z + 1, top + 128);
-						vertex[i++] = byte4(x + 1, y + 1, z, top + 128);
-						vertex[i++] = byte4(x + 1, y + 1, z, top + 128);
-						vertex[i++] = byte4(x, y + 1, z + 1, top + 128);
-						vertex[i++] = byte4(x + 1, y + 1, z + 1, top + 128);
-					}
-					vis = true;
-				}
-			}
-		}
+	// Read tile (x, z) from the cache, can be called from any thread
+	bool load(int x, int z, horizontile &tile) const {
+		if(!dir)
+			return false;
 
-		// View from negative z
+		char name[1024];
+		path(name, sizeof name, x, z);
 
-		for(int x = 0; x < CX; x++) {
-			for(int z = CZ - 1; z >= 0; z--) {
-				for(int y = 0; y < CY; y++) {
-					if(isblocked(x, y, z, x, y, z - 1)) {
-						vis = false;
-						continue;
-					}
+		int fd = ::open(name, O_RDONLY);
+		if(fd < 0)
+			return false;
 
-					uint8_t top = blk[x][y][z];
-					uint8_t bottom = blk[x][y][z];
-					uint8_t side = blk[x][y][z];
+		char magic[4];
+		uint8_t dim[4];
+		uint8_t expected[4] = {HSTEP, HSAMPLES, 0, 0};
+		bool ok = read(fd, magic, 4) == 4 && !memcmp(magic, "GCH1", 4)
+			&& read(fd, dim, 4) == 4 && !memcmp(dim, expected, 4)
+			&& read(fd, &tile, sizeof tile) == sizeof tile;
 
-					if(top == 3) {
-						bottom = 1;
-						side = 2;
-					} else if(top == 5) {
-						top = bottom = 12;
-					}
+		close(fd);
+		return ok;
+	}
 
-					if(vis && y != 0 && blk[x][y][z] == blk[x][y - 1][z]) {
-						vertex[i - 5] = byte4(x, y + 1, z, side);
-						vertex[i - 3] = byte4(x, y + 1, z, side);
-						vertex[i - 2] = byte4(x + 1, y + 1, z, side);
-						merged++;
-					} else {
-						vertex[i++] = byte4(x, y, z, side);
-						vertex[i++] = byte4(x, y + 1, z, side);
-						vertex[i++] = byte4(x + 1, y, z, side);
-						vertex[i++] = byte4(x, y + 1, z, side);
-						vertex[i++] = byte4(x + 1, y + 1, z, side);
-						vertex[i++] = byte4(x + 1, y, z, side);
-					}
-					vis = true;
-				}
-			}
-		}
+	// Write tile (x, z) to the cache, can be called from any thread
+	void save(int x, int z, const horizontile &tile) const {
+		if(!dir)
+			return;
 
-		// View from positive z
+		char name[1024];
+		path(name, sizeof name, x, z);
 
-		for(int x = 0; x < CX; x++) {
-			for(int z = 0; z < CZ; z++) {
-				for(int y = 0; y < CY; y++) {
-					if(isblocked(x, y, z, x, y, z + 1)) {
-						vis = false;
-						continue;
-					}
+		int fd = ::open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0)
+			return;
 
-					uint8_t top = blk[x][y][z];
-					uint8_t bottom = blk[x][y][z];
-					uint8_t side = blk[x][y][z];
+		uint8_t dim[4] = {HSTEP, HSAMPLES, 0, 0};
+		if(write(fd, "GCH1", 4) != 4 || write(fd, dim, 4) != 4 || write(fd, &tile, sizeof tile) != sizeof tile)
+			fprintf(stderr, "Cannot write %s: %s\n", name, strerror(errno));
 
-					if(top == 3) {
-						bottom = 1;
-						side = 2;
-					} else if(top == 5) {
-						top = bottom = 12;
-					}
+		close(fd);
+	}
 
-					if(vis && y != 0 && blk[x][y][z] == blk[x][y - 1][z]) {
-						vertex[i - 4] = byte4(x, y + 1, z + 1, side);
-						vertex[i - 3] = byte4(x, y + 1, z + 1, side);
-						vertex[i - 1] = byte4(x + 1, y + 1, z + 1, side);
-						merged++;
-					} else {
-						vertex[i++] = byte4(x, y, z + 1, side);
-						vertex[i++] = byte4(x + 1, y, z + 1, side);
-						vertex[i++] = byte4(x, y + 1, z + 1, side);
-						vertex[i++] = byte4(x, y + 1, z + 1, side);
-						vertex[i++] = byte4(x + 1, y, z + 1, side);
-						vertex[i++] = byte4(x + 1, y + 1, z + 1, side);
-					}
-					vis = true;
+	// Sample the land noise for tile (x, z), the same way chunk::generate() does
+	void sample(int x, int z, horizontile &tile) const {
+		for(int i = 0; i < HSAMPLES; i++) {
+			for(int j = 0; j < HSAMPLES; j++) {
+				int bx = x * HTILE + i * HSTEP;
+				int bz = z * HTILE + j * HSTEP;
+				float n = chunk::landnoise(bx, bz, seed);
+				int h = n * 2;
+
+				if(h < SEALEVEL) {
+					tile.height[i][j] = SEALEVEL;
+					tile.type[i][j] = 8;
+				} else {
+					tile.height[i][j] = std::min(h, 127);
+					tile.type[i][j] = chunk::landtype(bx, h - 1, bz, n, h, seed);
 				}
 			}
 		}
+	}
 
-		changed = false;
-		elements = i;
-
-		// If this chunk is empty, no need to allocate a chunk slot.
-		if(!elements)
-			return;
-
-		// If we don't have an active slot, find one
-		if(chunk_slot[slot] != this) {
-			int lru = 0;
-			for(int i = 0; i < CHUNKSLOTS; i++) {
-				// If there is an empty slot, use it
-				if(!chunk_slot[i]) {
-					lru = i;
-					break;
+	// Turn a tile into quads. Steep slopes are darkened like corners with ambient occlusion, and all of it is lit
+	// as if by the sky.
+	static void mesh(const horizontile &tile, byte4 *vertex) {
+		const struct facedir &fd = facedirs[FACE_PY];
+		int n = 0;
+
+		for(int i = 0; i < HSAMPLES - 1; i++) {
+			for(int j = 0; j < HSAMPLES - 1; j++) {
+				for(int k = 0; k < 6; k++) {
+					int a = i + fd.corner[k][0];
+					int b = j + fd.corner[k][1];
+					int slope = abs(tile.height[std::min(a + 1, HSAMPLES - 1)][b] - tile.height[std::max(a - 1, 0)][b])
+						+ abs(tile.height[a][std::min(b + 1, HSAMPLES - 1)] - tile.height[a][std::max(b - 1, 0)]);
+					int ao = std::min(3, slope / 8);
+					int w = facetexture(tile.type[i][j], FACE_PY) | 7 << 4;
+
+					vertex[n++] = byte4(fd.corner[k][0] * HSTEP | ao << 6, tile.height[a][b], fd.corner[k][1] * HSTEP, w);
 				}
-				// Otherwise try to find the least recently used slot
-				if(chunk_slot[i]->lastused < chunk_slot[lru]->lastused)
-					lru = i;
 			}
+		}
+	}
 
-			// If the slot is empty, create a new VBO
-			if(!chunk_slot[lru]) {
-				glGenBuffers(1, &vbo);
-			// Otherwise, steal it from the previous slot owner
-			} else {
-				vbo = chunk_slot[lru]->vbo;
-				chunk_slot[lru]->changed = true;
+	// Write the positions of the quads of tile (x, z) relative to the origin, in the slot of the tile
+	void place(int x, int z) {
+		GLshort offsets[HVERTICES * 4];
+		int n = 0;
+
+		for(int i = 0; i < HSAMPLES - 1; i++) {
+			for(int j = 0; j < HSAMPLES - 1; j++) {
+				for(int k = 0; k < 6; k++) {
+					offsets[n * 4 + 0] = x * HTILE + i * HSTEP - originx;
+					offsets[n * 4 + 1] = 0;
+					offsets[n * 4 + 2] = z * HTILE + j * HSTEP - originz;
+					offsets[n * 4 + 3] = 0;
+					n++;
+				}
 			}
-
-			slot = lru;
-			chunk_slot[slot] = this;
 		}
 
-		// Upload vertices
-
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		glBufferData(GL_ARRAY_BUFFER, i * sizeof *vertex, vertex, GL_STATIC_DRAW);
+		int first = (floormod(x, HTILES) * HTILES + floormod(z, HTILES)) * HVERTICES;
+		glBindBuffer(GL_ARRAY_BUFFER, offsetvbo);
+		glBufferSubData(GL_ARRAY_BUFFER, first * 4 * sizeof(GLshort), sizeof offsets, offsets);
 	}
 
-	void render() {
-		if(changed)
-			update();
+	// Write the positions of all tiles again, after the origin moved
+	void rebase() {
+		for(int x = 0; x < HTILES; x++)
+			for(int z = 0; z < HTILES; z++)
+				if(ready[x][z])
+					place(tx[x][z], tz[x][z]);
+	}
 
-		lastused = now;
+	// Give every slot the tile it should have around the camera, and queue the tiles that changed to be made
+	void update(const glm::vec3 &camera);
 
-		if(!elements)
-			return;
+	// Upload the quads of tile (x, z), unless its slot has been given another tile in the meantime
+	bool upload(int x, int z, const byte4 *vertex) {
+		int sx = floormod(x, HTILES);
+		int sz = floormod(z, HTILES);
+		if(tx[sx][sz] != x || tz[sx][sz] != z)
+			return false;
 
+		int first = (sx * HTILES + sz) * HVERTICES;
 		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		glVertexAttribPointer(attribute_coord, 4, GL_BYTE, GL_FALSE, 0, 0);
-		glDrawArrays(GL_TRIANGLES, 0, elements);
+		glBufferSubData(GL_ARRAY_BUFFER, first * sizeof *vertex, HVERTICES * sizeof *vertex, vertex);
+		place(x, z);
+		ready[sx][sz] = true;
+		return true;
 	}
-};
 
-struct superchunk {
-	chunk *c[SCX][SCY][SCZ];
-	time_t seed;
-
-	superchunk() {
-		seed = time(NULL);
-		for(int x = 0; x < SCX; x++)
-			for(int y = 0; y < SCY; y++)
-				for(int z = 0; z < SCZ; z++)
-					c[x][y][z] = new chunk(x - SCX / 2, y - SCY / 2, z - SCZ / 2);
+	// Draw all tiles with the given view-projection matrix, except within hole blocks of the camera,
+	// where the chunks are loaded
+	void render(const glm::mat4 &pv, const glm::vec3 &camera, float hole) {
+		update(camera);
 
-		for(int x = 0; x < SCX; x++)
-			for(int y = 0; y < SCY; y++)
-				for(int z = 0; z < SCZ; z++) {
-					if(x > 0)
-						c[x][y][z]->left = c[x - 1][y][z];
-					if(x < SCX - 1)
-						c[x][y][z]->right = c[x + 1][y][z];
-					if(y > 0)
-						c[x][y][z]->below = c[x][y - 1][z];
-					if(y < SCY - 1)
-						c[x][y][z]->above = c[x][y + 1][z];
-					if(z > 0)
-						c[x][y][z]->front = c[x][y][z - 1];
-					if(z < SCZ - 1)
-						c[x][y][z]->back = c[x][y][z + 1];
-				}
-	}
+		glm::mat4 mvp = pv * glm::translate(glm::mat4(1.0f), glm::vec3(originx, 0, originz));
+		glUniformMatrix4fv(uniform_mvp, 1, GL_FALSE, glm::value_ptr(mvp));
+		glUniform2f(uniform_holecenter, camera.x - originx, camera.z - originz);
+		glUniform1f(uniform_holeradius, hole);
 
-	uint8_t get(int x, int y, int z) const {
-		int cx = (x + CX * (SCX / 2)) / CX;
-		int cy = (y + CY * (SCY / 2)) / CY;
-		int cz = (z + CZ * (SCZ / 2)) / CZ;
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		coordpointer(0);
+		glBindBuffer(GL_ARRAY_BUFFER, offsetvbo);
+		glEnableVertexAttribArray(attribute_offset);
+		glVertexAttribPointer(attribute_offset, 4, GL_SHORT, GL_FALSE, 0, 0);
 
-		if(cx < 0 || cx >= SCX || cy < 0 || cy >= SCY || cz <= 0 || cz >= SCZ)
-			return 0;
+		glDrawArrays(GL_TRIANGLES, 0, HTILES * HTILES * HVERTICES);
 
-		return c[cx][cy][cz]->get(x & (CX - 1), y & (CY - 1), z & (CZ - 1));
+		glDisableVertexAttribArray(attribute_offset);
+		glVertexAttrib4f(attribute_offset, 0, 0, 0, 0);
+		glUniform1f(uniform_holeradius, 0);
 	}
 
-	void set(int x, int y, int z, uint8_t type) {
-		int cx = (x + CX * (SCX / 2)) / CX;
-		int cy = (y + CY * (SCY / 2)) / CY;
-		int cz = (z + CZ * (SCZ / 2)) / CZ;
-
-		if(cx < 0 || cx >= SCX || cy < 0 || cy >= SCY || cz <= 0 || cz >= SCZ)
-			return;
+	void print_stats() const {
+		int n = 0;
+		for(int x = 0; x < HTILES; x++)
+			for(int z = 0; z < HTILES; z++)
+				n += ready[x][z];
 
-		c[cx][cy][cz]->set(x & (CX - 1), y & (CY - 1), z & (CZ - 1), type);
+		fprintf(stderr, "Horizon: %d of %d tiles ready, %ld sampled from the noise, %ld read from the cache\n", n, HTILES * HTILES, generated, cached);
 	}
+};
 
-	void render(const glm::mat4 &pv) {
-		float ud = 1.0 / 0.0;
-		int ux = -1;
-		int uy = -1;
-		int uz = -1;
-
-		for(int x = 0; x < SCX; x++) {
-			for(int y = 0; y < SCY; y++) {
-				for(int z = 0; z < SCZ; z++) {
-					glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(c[x][y][z]->ax * CX, c[x][y][z]->ay * CY, c[x][y][z]->az * CZ));
-					glm::mat4 mvp = pv * model;
+static horizonlayer *horizon;
 
-					// Is this chunk on the screen?
-					glm::vec4 center = mvp * glm::vec4(CX / 2, CY / 2, CZ / 2, 1);
+// Makes one tile of the horizon on a worker thread, reading it from the cache if it is there
+struct horizonjob: job {
+	int x;
+	int z;
+	bool fromcache;
+	horizontile tile;
+	byte4 vertex[HVERTICES];
 
-					float d = glm::length(center);
-					center.x /= center.w;
-					center.y /= center.w;
+	horizonjob(int x, int z, float priority): job(priority), x(x), z(z), fromcache(false) {}
 
-					// If it is behind the camera, don't bother drawing it
-					if(center.z < -CY / 2)
-						continue;
+	void run() {
+		fromcache = horizon->load(x, z, tile);
+		if(!fromcache) {
+			horizon->sample(x, z, tile);
+			horizon->save(x, z, tile);
+		}
 
-					// If it is outside the screen, don't bother drawing it
-					if(fabsf(center.x) > 1 + fabsf(CY * 2 / center.w) || fabsf(center.y) > 1 + fabsf(CY * 2 / center.w))
-						continue;
+		horizonlayer::mesh(tile, vertex);
+	}
 
-					// If this chunk is not initialized, skip it
-					if(!c[x][y][z]->initialized) {
-						// But if it is the closest to the camera, mark it for initialization
-						if(ux < 0 || d < ud) {
-							ud = d;
-							ux = x;
-							uy = y;
-							uz = z;
-						}
-						continue;
-					}
+	int finish() {
+		if(fromcache)
+			horizon->cached++;
+		else
+			horizon->generated++;
 
-					glUniformMatrix4fv(uniform_mvp, 1, GL_FALSE, glm::value_ptr(mvp));
+		return horizon->upload(x, z, vertex);
+	}
+};
 
-					c[x][y][z]->render();
-				}
+void horizonlayer::update(const glm::vec3 &camera) {
+	int cx = floordiv((int)floorf(camera.x), HTILE);
+	int cz = floordiv((int)floorf(camera.z), HTILE);
+
+	for(int x = cx - HTILES / 2; x < cx + HTILES - HTILES / 2; x++) {
+		for(int z = cz - HTILES / 2; z < cz + HTILES - HTILES / 2; z++) {
+			int sx = floormod(x, HTILES);
+			int sz = floormod(z, HTILES);
+			if(tx[sx][sz] == x && tz[sx][sz] == z)
+				continue;
+
+			// Stop drawing the old tile until the new one is there
+			if(ready[sx][sz]) {
+				std::vector<byte4> zero(HVERTICES, byte4(0, 0, 0, 0));
+				glBindBuffer(GL_ARRAY_BUFFER, vbo);
+				glBufferSubData(GL_ARRAY_BUFFER, (sx * HTILES + sz) * HVERTICES * sizeof(byte4), HVERTICES * sizeof(byte4), zero.data());
+				ready[sx][sz] = false;
 			}
-		}
 
-		if(ux >= 0) {
-			c[ux][uy][uz]->noise(seed);
-			if(c[ux][uy][uz]->left)
-				c[ux][uy][uz]->left->noise(seed);
-			if(c[ux][uy][uz]->right)
-				c[ux][uy][uz]->right->noise(seed);
-			if(c[ux][uy][uz]->below)
-				c[ux][uy][uz]->below->noise(seed);
-			if(c[ux][uy][uz]->above)
-				c[ux][uy][uz]->above->noise(seed);
-			if(c[ux][uy][uz]->front)
-				c[ux][uy][uz]->front->noise(seed);
-			if(c[ux][uy][uz]->back)
-				c[ux][uy][uz]->back->noise(seed);
-			c[ux][uy][uz]->initialized = true;
+			tx[sx][sz] = x;
+			tz[sx][sz] = z;
+
+			glm::vec3 center((x + 0.5) * HTILE, camera.y, (z + 0.5) * HTILE);
+			jobqueue.push(new horizonjob(x, z, glm::length(center - camera)));
 		}
 	}
-};
-
-static superchunk *world;
+}
 
 // Calculate the forward, right and lookat vectors from the angle vector
 static void update_vectors() {
@@ -718,10 +4547,21 @@ static int init_resources() {
 	if(program == 0)
 		return 0;
 
+	// Make sure coord is attribute 0, which some drivers require to be enabled
+	glBindAttribLocation(program, 0, "coord");
+	glLinkProgram(program);
+
 	attribute_coord = get_attrib(program, "coord");
+	attribute_offset = get_attrib(program, "offset");
 	uniform_mvp = get_uniform(program, "mvp");
-
-	if(attribute_coord == -1 || uniform_mvp == -1)
+	uniform_compact = get_uniform(program, "compact");
+	uniform_meshed = get_uniform(program, "meshed");
+	uniform_cutoff = get_uniform(program, "cutoff");
+	uniform_holecenter = get_uniform(program, "holecenter");
+	uniform_holeradius = get_uniform(program, "holeradius");
+
+	if(attribute_coord == -1 || attribute_offset == -1 || uniform_mvp == -1 || uniform_compact == -1 || uniform_meshed == -1 || uniform_cutoff == -1
+			|| uniform_holecenter == -1 || uniform_holeradius == -1)
 		return 0;
 
 	/* Create and upload the texture */
@@ -732,9 +4572,15 @@ static int init_resources() {
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, textures.width, textures.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, textures.pixel_data);
 	glGenerateMipmap(GL_TEXTURE_2D);
 
+	/* Start the worker threads, leaving one core for the main thread */
+
+	int threads = std::thread::hardware_concurrency();
+	jobqueue.start(threads > 1 ? threads - 1 : 1);
+
 	/* Create the world */
 
-	world = new superchunk;
+	world = new superchunk(seed, worlddir);
+	horizon = new horizonlayer(seed, worlddir);
 
 	position = glm::vec3(0, CY + 1, 0);
 	angle = glm::vec3(0, -0.5, 0);
@@ -748,8 +4594,11 @@ static int init_resources() {
 
 	glUseProgram(program);
 	glUniform1i(uniform_texture, 0);
+	glUniform1f(uniform_cutoff, 0.4);
+	glUniform1f(uniform_holeradius, 0);
 	glClearColor(0.6, 0.8, 1.0, 0.0);
 	glEnable(GL_CULL_FACE);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST); // Use GL_NEAREST_MIPMAP_LINEAR if you want to use mipmaps
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -757,6 +4606,7 @@ static int init_resources() {
 	glPolygonOffset(1, 1);
 
 	glEnableVertexAttribArray(attribute_coord);
+	glVertexAttrib4f(attribute_offset, 0, 0, 0, 0);
 
 	return 1;
 }
@@ -788,9 +4638,27 @@ static void display() {
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_POLYGON_OFFSET_FILL);
 
+	/* Keep the origin of the positions in the vertex arena and the horizon near the camera */
+
+	int ox = (int)floorf(position.x / ORIGINSTEP + 0.5) * ORIGINSTEP;
+	int oz = (int)floorf(position.z / ORIGINSTEP + 0.5) * ORIGINSTEP;
+
+	if(abs(ox - originx) > ORIGINSTEP || abs(oz - originz) > ORIGINSTEP) {
+		originx = ox;
+		originz = oz;
+		horizon->rebase();
+	}
+
+	/* First draw the far away terrain, and clear the depth buffer so the chunks are always drawn over it */
+
+	if(draw_horizon) {
+		horizon->render(mvp, position, world->radius * CX);
+		glClear(GL_DEPTH_BUFFER_BIT);
+	}
+
 	/* Then draw chunks */
 
-	world->render(mvp);
+	world->render(mvp, position);
 
 	/* At which voxel are we looking? */
 
@@ -836,50 +4704,19 @@ static void display() {
 		if(face == 2 && lookat.z > 0)
 			face += 3;
 	} else {
-		/* Very naive ray casting algorithm to find out which block we are looking at */
-
-		glm::vec3 testpos = position;
-		glm::vec3 prevpos = position;
-
-		for(int i = 0; i < 100; i++) {
-			/* Advance from our currect position to the direction we are looking at, in small steps */
-
-			prevpos = testpos;
-			testpos += lookat * 0.1f;
-
-			mx = floorf(testpos.x);
-			my = floorf(testpos.y);
-			mz = floorf(testpos.z);
+		/* Follow the ray we are looking along through the blocks, up to 10 blocks away */
 
-			/* If we find a block that is not air, we are done */
+		raycasthit hit;
 
-			if(world->get(mx, my, mz))
-				break;
-		}
-
-		/* Find out which face of the block we are looking at */
-
-		int px = floorf(prevpos.x);
-		int py = floorf(prevpos.y);
-		int pz = floorf(prevpos.z);
-
-		if(px > mx)
-			face = 0;
-		else if(px < mx)
-			face = 3;
-		else if(py > my)
-			face = 1;
-		else if(py < my)
-			face = 4;
-		else if(pz > mz)
-			face = 2;
-		else if(pz < mz)
-			face = 5;
-
-		/* If we are looking at air, move the cursor out of sight */
-
-		if(!world->get(mx, my, mz))
+		if(world->raycast(position, lookat, 10, hit)) {
+			mx = hit.x;
+			my = hit.y;
+			mz = hit.z;
+			face = hit.face;
+		} else {
+			/* If we are looking at air, move the cursor out of sight */
 			mx = my = mz = 99999;
+		}
 	}
 
 	float bx = mx;
@@ -919,6 +4756,8 @@ static void display() {
 
 	glDisable(GL_POLYGON_OFFSET_FILL);
 	glDisable(GL_CULL_FACE);
+	glUniform1i(uniform_compact, 0);
+	glUniform1i(uniform_meshed, 0);
 	glUniformMatrix4fv(uniform_mvp, 1, GL_FALSE, glm::value_ptr(mvp));
 	glBindBuffer(GL_ARRAY_BUFFER, cursor_vbo);
 	glBufferData(GL_ARRAY_BUFFER, sizeof box, box, GL_DYNAMIC_DRAW);
@@ -972,7 +4811,7 @@ static void special(int key, int x, int y) {
 			update_vectors();
 			break;
 		case GLUT_KEY_END:
-			position = glm::vec3(0, CX * SCX, 0);
+			position = glm::vec3(0, CX * SCX / 2, 0);
 			angle = glm::vec3(0, -M_PI * 0.49, 0);
 			update_vectors();
 			break;
@@ -983,6 +4822,75 @@ static void special(int key, int x, int y) {
 			else
 				printf("Using ray casting selection method\n");
 			break;
+		case GLUT_KEY_F2:
+			greedy_meshing = !greedy_meshing;
+			if(greedy_meshing)
+				printf("Using greedy meshing\n");
+			else
+				printf("Merging faces along one axis only\n");
+			world->remesh();
+			break;
+		case GLUT_KEY_F3:
+			bitmask_faces = !bitmask_faces;
+			if(bitmask_faces)
+				printf("Finding visible faces with bitmasks of whole columns\n");
+			else
+				printf("Finding visible faces block by block\n");
+			world->remesh();
+			break;
+		case GLUT_KEY_F4:
+			if(!vertexarena::supported()) {
+				printf("Drawing all chunks from a single buffer needs OpenGL 4.3, or ARB_copy_buffer, ARB_multi_draw_indirect and ARB_base_instance\n");
+				break;
+			}
+			arena_mode = !arena_mode;
+			if(arena_mode)
+				printf("Drawing all chunks from a single buffer\n");
+			else
+				printf("Drawing every chunk from its own buffer\n");
+			world->remesh();
+			break;
+		case GLUT_KEY_F5:
+			occlusion_culling = !occlusion_culling;
+			if(occlusion_culling)
+				printf("Culling chunks hidden behind other chunks\n");
+			else
+				printf("Drawing all chunks in the view frustum\n");
+			break;
+		case GLUT_KEY_F6:
+			indexed_quads = !indexed_quads;
+			if(indexed_quads)
+				printf("Drawing quads from four vertices and a shared index buffer\n");
+			else
+				printf("Drawing quads as two separate triangles\n");
+			world->remesh();
+			break;
+		case GLUT_KEY_F7:
+			compact_vertices = !compact_vertices;
+			if(compact_vertices)
+				printf("Using compact vertices with face and ambient occlusion\n");
+			else
+				printf("Using plain vertices\n");
+			world->remesh();
+			break;
+		case GLUT_KEY_F8:
+			lod_meshing = !lod_meshing;
+			if(lod_meshing)
+				printf("Meshing chunks further than %d blocks away with less detail\n", lod_distance);
+			else
+				printf("Meshing all chunks with full detail\n");
+			break;
+		case GLUT_KEY_F9:
+			draw_horizon = !draw_horizon;
+			if(draw_horizon)
+				printf("Drawing the far away terrain\n");
+			else
+				printf("Not drawing the far away terrain\n");
+			break;
+		case GLUT_KEY_F12:
+			world->print_stats();
+			horizon->print_stats();
+			break;
 	}
 }
 
@@ -1013,7 +4921,6 @@ static void idle() {
 	static int pt = 0;
 	static const float movespeed = 10;
 
-	now = time(0);
 	int t = glutGet(GLUT_ELAPSED_TIME);
 	float dt = (t - pt) * 1.0e-3;
 	pt = t;
@@ -1094,16 +5001,553 @@ static void mouse(int button, int state, int x, int y) {
 		if(face == 5)
 			mz--;
 		world->set(mx, my, mz, buildtype);
+	} else if(button == 1) {
+		// Blow away a sphere of blocks around the selected one, all in one go
+		std::vector<blockedit> edits;
+		for(int dx = -4; dx <= 4; dx++) {
+			for(int dy = -4; dy <= 4; dy++) {
+				for(int dz = -4; dz <= 4; dz++) {
+					if(dx * dx + dy * dy + dz * dz > 16)
+						continue;
+					blockedit e = {mx + dx, my + dy, mz + dz, 0};
+					edits.push_back(e);
+				}
+			}
+		}
+		world->set(edits);
 	} else {
 		world->set(mx, my, mz, 0);
 	}
 }
 
 static void free_resources() {
+	jobqueue.stop();
+	if(world)
+		world->save();
 	glDeleteProgram(program);
 }
 
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Compare the batched noise kernels against glm::simplex(), both for raw samples and for whole chunks
+static void bench_noise() {
+	const int count = 1 << 20;
+	std::vector<float> x(count), y(count), z(count), a(count), b(count);
+
+	for(int i = 0; i < count; i++) {
+		x[i] = (rand() % 65536) / 256.0;
+		y[i] = (rand() % 65536) / 256.0;
+		z[i] = (rand() % 65536) / 256.0;
+	}
+
+	const char *lanes = "scalar";
+#ifdef __SSE2__
+	lanes = "SSE2";
+#endif
+#ifdef __AVX__
+	lanes = "AVX";
+#endif
+	printf("Batched noise kernel uses %s\n", lanes);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for(int i = 0; i < count; i++)
+		a[i] = chunk::noise2d(x[i], z[i], 1, 5, 0.8);
+	double tglm = seconds_since(start);
+
+	start = std::chrono::steady_clock::now();
+	chunk::noise2d_batch(x.data(), z.data(), b.data(), count, 1, 5, 0.8);
+	double tbatch = seconds_since(start);
+
+	float diff = 0;
+	for(int i = 0; i < count; i++)
+		diff = fmaxf(diff, fabsf(a[i] - b[i]));
+	printf("2D, 5 octaves: glm %.1f ns/sample, batched %.1f ns/sample, %.1fx faster, max difference %g\n", tglm * 1e9 / count, tbatch * 1e9 / count, tglm / tbatch, diff);
+
+	start = std::chrono::steady_clock::now();
+	for(int i = 0; i < count; i++)
+		a[i] = chunk::noise3d_abs(x[i], y[i], z[i], 1, 2, 1);
+	tglm = seconds_since(start);
+
+	start = std::chrono::steady_clock::now();
+	chunk::noise3d_abs_batch(x.data(), y.data(), z.data(), b.data(), count, 1, 2, 1);
+	tbatch = seconds_since(start);
+
+	diff = 0;
+	for(int i = 0; i < count; i++)
+		diff = fmaxf(diff, fabsf(a[i] - b[i]));
+	printf("3D, 2 octaves: glm %.1f ns/sample, batched %.1f ns/sample, %.1fx faster, max difference %g\n", tglm * 1e9 / count, tbatch * 1e9 / count, tglm / tbatch, diff);
+
+	// Generate the same chunks with both methods, and count how many blocks come out different
+	static uint8_t blk[2][CX][CY][CZ];
+	double t[2] = {0, 0};
+	long different = 0;
+	const int chunks = 256;
+
+	for(int i = 0; i < chunks; i++) {
+		for(int j = 0; j < 2; j++) {
+			simd_noise = j;
+			start = std::chrono::steady_clock::now();
+			chunk::generate(blk[j], i % 16 - 8, i / 128 - 1, i / 16 % 8 - 4, 1);
+			t[j] += seconds_since(start);
+		}
+		for(int j = 0; j < CX * CY * CZ; j++)
+			different += (&blk[0][0][0][0])[j] != (&blk[1][0][0][0])[j];
+	}
+
+	simd_noise = true;
+	printf("Chunk generation: glm %.2f ms/chunk, batched %.2f ms/chunk, %.1fx faster, %ld of %d blocks different\n", t[0] * 1e3 / chunks, t[1] * 1e3 / chunks, t[0] / t[1], different, chunks * CX * CY * CZ);
+}
+
+// Mesh the same chunks with per-block and with bitmask face visibility, and check that both give exactly the same mesh.
+// Then change a block in every chunk, and check that remeshing only the stale sections matches a whole new mesh.
+// The chunks are generated terrain with more and more random blocks of all types mixed in, and have neighbours on all sides.
+static bool verify_mesher() {
+	const int n = 3;
+	const int rounds = 12;
+	static uint8_t blk[CX][CY][CZ];
+	chunk *c[n][n][n];
+	double t[2] = {0, 0};
+	double tfaces[2] = {0, 0};
+	double tpatch = 0;
+	int patches = 0;
+	int meshes = 0;
+	int different = 0;
+	int kept = 0;
+	int missed = 0;
+
+	for(int r = 0; r < rounds; r++) {
+		for(int x = 0; x < n; x++) {
+			for(int y = 0; y < n; y++) {
+				for(int z = 0; z < n; z++) {
+					c[x][y][z] = new chunk(r * n + x, y - 1, z);
+					chunk::generate(blk, r * n + x, y - 1, z, 1);
+
+					for(int i = 0; i < CX * CY * CZ * (r % 4) / 4; i++)
+						blk[rand() % CX][rand() % CY][rand() % CZ] = rand() % 16;
+
+					c[x][y][z]->blocks.pack(&blk[0][0][0]);
+				}
+			}
+		}
+
+		for(int x = 0; x < n; x++) {
+			for(int y = 0; y < n; y++) {
+				for(int z = 0; z < n; z++) {
+					chunk *ch = c[x][y][z];
+					ch->left = x > 0 ? c[x - 1][y][z] : 0;
+					ch->right = x < n - 1 ? c[x + 1][y][z] : 0;
+					ch->below = y > 0 ? c[x][y - 1][z] : 0;
+					ch->above = y < n - 1 ? c[x][y + 1][z] : 0;
+					ch->front = z > 0 ? c[x][y][z - 1] : 0;
+					ch->back = z < n - 1 ? c[x][y][z + 1] : 0;
+				}
+			}
+		}
+
+		for(int i = 0; i < n * n * n; i++) {
+			chunk *ch = (&c[0][0][0])[i];
+
+			bitmask_faces = false;
+			meshjob<CX, CY, CZ> a(ch);
+			bitmask_faces = true;
+			meshjob<CX, CY, CZ> b(ch);
+
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			a.run();
+			t[0] += seconds_since(start);
+
+			start = std::chrono::steady_clock::now();
+			b.run();
+			t[1] += seconds_since(start);
+
+			// Also time finding the visible faces on its own, without merging them and the rest of the mesher
+			int *mask = scratch<CX, CY, CZ>().mask;
+			int dim[3] = {CX, CY, CZ};
+			for(int j = 0; j < 2; j++) {
+				meshjob<CX, CY, CZ> &m = j ? b : a;
+				start = std::chrono::steady_clock::now();
+				if(m.bitmask)
+					m.visiblefaces();
+				for(int f = 0; f < 6; f++)
+					for(int s = 0; s < dim[facedirs[f].d]; s++)
+						m.slicefaces(f, s, 0, CY, mask);
+				tfaces[j] += seconds_since(start);
+			}
+
+			if(a.vertices != b.vertices || a.quads != b.quads || a.merged != b.merged || memcmp(a.connects, b.connects, sizeof a.connects))
+				different++;
+			meshes++;
+
+			// Change one block, and remesh only the stale sections as if patching the mesh made by b
+			ch->stale = 0;
+			ch->set(rand() % CX, rand() % CY, rand() % CZ, rand() % 16);
+
+			meshjob<CX, CY, CZ> whole(ch);
+			meshjob<CX, CY, CZ> part(ch);
+			part.sections = ch->stale;
+			part.patch = true;
+			memcpy(part.section, b.section, sizeof part.section);
+
+			whole.run();
+			start = std::chrono::steady_clock::now();
+			part.run();
+			tpatch += seconds_since(start);
+
+			// The new sections must be the same as in a whole new mesh, unless they had to be laid out again
+			int offset = 0;
+			for(int k = 0; k < MESHSECTIONS && part.patch; k++) {
+				if(!(part.sections & 1 << k % SECTIONS))
+					continue;
+				const meshsection &p = part.section[k];
+				const meshsection &w = whole.section[k];
+				if(p.count != w.count || !std::equal(&part.vertices[offset], &part.vertices[offset] + p.count, &whole.vertices[w.first]))
+					different++;
+				offset += p.room;
+			}
+
+			if(part.quads != whole.quads || part.merged != whole.merged || memcmp(part.connects, whole.connects, sizeof part.connects))
+				different++;
+			patches += part.patch;
+		}
+
+		// Change a block on a corner of the middle chunk. Every section that is not marked stale, in the middle
+		// chunk or in any of the chunks around it, must be the same in a whole new mesh as it was before.
+		std::vector<byte4> before[n * n * n];
+		meshsection layout[n * n * n][MESHSECTIONS];
+
+		for(int i = 0; i < n * n * n; i++) {
+			chunk *ch = (&c[0][0][0])[i];
+			meshjob<CX, CY, CZ> m(ch);
+			m.run();
+			before[i] = m.vertices;
+			memcpy(layout[i], m.section, sizeof layout[i]);
+			ch->stale = 0;
+		}
+
+		chunk *middle = c[n / 2][n / 2][n / 2];
+		int x = rand() % 2 * (CX - 1);
+		int y = rand() % 2 * (CY - 1);
+		int z = rand() % 2 * (CZ - 1);
+		middle->set(x, y, z, middle->get(x, y, z) ? 0 : rand() % 15 + 1);
+
+		for(int i = 0; i < n * n * n; i++) {
+			chunk *ch = (&c[0][0][0])[i];
+			meshjob<CX, CY, CZ> m(ch);
+			m.run();
+
+			for(int k = 0; k < MESHSECTIONS; k++) {
+				if(ch->stale & 1 << k % SECTIONS)
+					continue;
+				const meshsection &o = layout[i][k];
+				const meshsection &w = m.section[k];
+				if(o.count != w.count || !std::equal(&before[i][o.first], &before[i][o.first] + o.count, &m.vertices[w.first]))
+					missed++;
+				kept++;
+			}
+		}
+
+		for(int i = 0; i < n * n * n; i++)
+			delete (&c[0][0][0])[i];
+	}
+
+	printf("Finding visible faces: per block %.3f ms/chunk, bitmask %.3f ms/chunk, %.1fx faster\n", tfaces[0] * 1e3 / meshes, tfaces[1] * 1e3 / meshes, tfaces[0] / tfaces[1]);
+	printf("Whole mesher: per block %.3f ms/chunk, bitmask %.3f ms/chunk, %.1fx faster, %d of %d meshes different\n", t[0] * 1e3 / meshes, t[1] * 1e3 / meshes, t[0] / t[1], different, meshes);
+	printf("Remeshing after changing one block: %.3f ms/chunk, %d of %d times only the stale sections\n", tpatch * 1e3 / meshes, patches, meshes);
+	printf("Changing a block on the corner of a chunk: %d of %d sections not marked stale changed anyway\n", missed, kept);
+	return !different && !missed;
+}
+
+// The ray casting that was used for picking before superchunk::raycast(): step along the ray in small
+// increments, and stop at the first block that is not air. It can miss blocks the ray only clips.
+static bool stepcast(const superchunk *w, const glm::vec3 &origin, const glm::vec3 &dir, int &x, int &y, int &z) {
+	glm::vec3 testpos = origin;
+
+	for(int i = 0; i < 100; i++) {
+		testpos += dir * 0.1f;
+		x = floorf(testpos.x);
+		y = floorf(testpos.y);
+		z = floorf(testpos.z);
+		if(w->get(x, y, z))
+			return true;
+	}
+
+	return false;
+}
+
+// Cast the same random rays of 10 blocks with stepcast() and superchunk::raycast(), and compare the speed and the results.
+// Then do the same for long rays with and without skipping empty space.
+static void bench_raycast() {
+	view_radius = 4;
+	superchunk *w = new superchunk(1, 0);
+	w->stream(glm::vec3(0, 0, 0));
+	for(int i = 0; i < SCX * SCY * SCZ; i++)
+		if((&w->c[0][0][0])[i])
+			(&w->c[0][0][0])[i]->noise(w->seed);
+
+	const int count = 1 << 18;
+	std::vector<glm::vec3> origin(count), dir(count);
+	for(int i = 0; i < count; i++) {
+		origin[i] = glm::vec3(rand() % 4096 / 64.0 - 32, rand() % 2048 / 64.0, rand() % 4096 / 64.0 - 32);
+		dir[i] = glm::normalize(glm::vec3(rand() % 2048 - 1024, rand() % 2048 - 1024, rand() % 2048 - 1024) + glm::vec3(0.5));
+	}
+
+	std::vector<int> found(count * 3);
+	int steps = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for(int i = 0; i < count; i++)
+		steps += stepcast(w, origin[i], dir[i], found[i * 3], found[i * 3 + 1], found[i * 3 + 2]);
+	double tstep = seconds_since(start);
+
+	std::vector<raycasthit> hit(count);
+	int hits = 0;
+	start = std::chrono::steady_clock::now();
+	for(int i = 0; i < count; i++)
+		hits += w->raycast(origin[i], dir[i], 10, hit[i]);
+	double tray = seconds_since(start);
+
+	// The fixed steps can skip blocks, and go slightly beyond 10 blocks
+	int different = 0;
+	for(int i = 0; i < count; i++)
+		if(!hit[i].type != !w->get(found[i * 3], found[i * 3 + 1], found[i * 3 + 2]) || (hit[i].type && (hit[i].x != found[i * 3] || hit[i].y != found[i * 3 + 1] || hit[i].z != found[i * 3 + 2])))
+			different++;
+
+	printf("Ray casting %d rays: fixed steps %.3f us/ray (%d hits), grid traversal %.3f us/ray (%d hits), %.1fx faster, %d different blocks found\n",
+		count, tstep * 1e6 / count, steps, tray * 1e6 / count, hits, tstep / tray, different);
+
+	// Long rays from above the ground, mostly through empty sky, with and without skipping empty bricks and chunks
+	for(int i = 0; i < count; i++)
+		origin[i].y += 24;
+
+	double tlong[2];
+	std::vector<raycasthit> longhit[2];
+	for(int j = 0; j < 2; j++) {
+		skip_empty_space = j;
+		longhit[j].resize(count);
+		start = std::chrono::steady_clock::now();
+		for(int i = 0; i < count; i++)
+			if(!w->raycast(origin[i], dir[i], 256, longhit[j][i]))
+				longhit[j][i].type = 0;
+		tlong[j] = seconds_since(start);
+	}
+
+	different = 0;
+	for(int i = 0; i < count; i++) {
+		const raycasthit &a = longhit[0][i];
+		const raycasthit &b = longhit[1][i];
+		if(a.type != b.type || (a.type && (a.x != b.x || a.y != b.y || a.z != b.z || a.face != b.face)))
+			different++;
+	}
+
+	printf("Ray casting %d rays of 256 blocks: every block %.3f us/ray, skipping empty space %.3f us/ray, %.1fx faster, %d different blocks found\n",
+		count, tlong[0] * 1e6 / count, tlong[1] * 1e6 / count, tlong[0] / tlong[1], different);
+
+	delete w;
+}
+
+// Generate, mesh and draw the same view of the world with chunks of size CX by CY by CZ, and print how long it takes.
+// The world is always 512 blocks wide and 64 blocks high.
+template<int CX, int CY, int CZ> static void bench_chunksize() {
+	typedef basicsuperchunk<CX, CY, CZ, 512 / CX, 64 / CY, 512 / CZ> benchworld;
+	typedef typename benchworld::chunk benchchunk;
+
+	benchworld *w = new benchworld(seed, 0);
+	benchchunk **all = &w->c[0][0][0];
+	const int n = sizeof w->c / sizeof *all;
+	glm::vec3 camera(0, 33, 0);
+	glm::vec3 dir(0, sinf(-0.5), cosf(-0.5));
+	glm::mat4 pv = glm::perspective(45.0f, 640.0f / 480.0f, 0.01f, 1000.0f) * glm::lookAt(camera, camera + dir, glm::vec3(0, 1, 0));
+
+	// Generate all chunks within range on the worker threads
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	w->stream(camera);
+	for(int i = 0; i < n; i++)
+		w->generate(all[i], 0);
+	while(generating)
+		jobqueue.finish(1 << 30);
+	double tgenerate = seconds_since(start);
+
+	// Light them on the worker threads, before meshing because the meshes depend on the light
+	start = std::chrono::steady_clock::now();
+	w->lightcolumns(n);
+	while(lighting)
+		jobqueue.finish(1 << 30);
+	double tlight = seconds_since(start);
+
+	// Give them the level of detail that rendering would, so they do not have to be meshed again
+	for(int i = 0; i < n; i++) {
+		benchchunk *ch = all[i];
+		if(ch) {
+			glm::vec3 center(ch->ax * CX + CX / 2, ch->ay * CY + CY / 2, ch->az * CZ + CZ / 2);
+			ch->lod = w->lodlevel(glm::length(center - camera), 0);
+		}
+	}
+
+	// Mesh them on this thread, to measure the mesher alone
+	int chunks = 0;
+	long quads = 0;
+	long vertices = 0;
+	double tmesh = 0;
+
+	for(int i = 0; i < n; i++) {
+		benchchunk *ch = all[i];
+		if(!ch)
+			continue;
+
+		start = std::chrono::steady_clock::now();
+		meshjob<CX, CY, CZ> j(ch);
+		j.run();
+		tmesh += seconds_since(start);
+
+		// Lighting left all sections stale, but this mesh is up to date
+		ch->changed = false;
+		ch->stale = 0;
+		ch->initialized = true;
+		j.finish();
+
+		chunks++;
+		quads += j.quads;
+		vertices += j.vertices.size();
+	}
+
+	// Draw the same view a number of times
+	const int frames = 100;
+	int drawn = 0;
+	glViewport(0, 0, 640, 480);
+	glFinish();
+	start = std::chrono::steady_clock::now();
+	for(int i = 0; i < frames; i++) {
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		w->render(pv, camera);
+		drawn = w->drawn;
+	}
+	glFinish();
+	double trender = seconds_since(start);
+
+	// Rendering may have queued jobs for these chunks after all
+	jobqueue.drain();
+
+	printf("%2dx%2dx%2d: %6d chunks, generating %7.1f ms, lighting %7.1f ms, meshing %7.1f ms (%6.3f ms/chunk), %8ld quads, %6.1f MB vertices, %5d chunks drawn, %6.2f ms/frame\n",
+		CX, CY, CZ, chunks, tgenerate * 1e3, tlight * 1e3, tmesh * 1e3, tmesh * 1e3 / chunks, quads, vertices * sizeof(byte4) / 1e6, drawn, trender * 1e3 / frames);
+
+	delete w;
+}
+
+static void bench_chunksizes() {
+	printf("Comparing chunk sizes, with the world seen from the starting position:\n");
+	bench_chunksize<8, 8, 8>();
+	bench_chunksize<16, 16, 16>();
+	bench_chunksize<16, 32, 16>();
+	bench_chunksize<32, 16, 32>();
+	bench_chunksize<32, 32, 32>();
+}
+
+// Draw the same view of the world with one buffer per chunk and with all chunks in the vertex arena,
+// and print how long it takes the CPU to issue the draw calls, and how long it takes until they are done.
+static void bench_arena() {
+	typedef basicsuperchunk<CX, CY, CZ, 512 / CX, 64 / CY, 512 / CZ> benchworld;
+	typedef benchworld::chunk benchchunk;
+
+	benchworld *w = new benchworld(seed, 0);
+	benchchunk **all = &w->c[0][0][0];
+	const int n = sizeof w->c / sizeof *all;
+	glm::vec3 camera(0, 33, 0);
+	glm::vec3 dir(0, sinf(-0.5), cosf(-0.5));
+	glm::mat4 pv = glm::perspective(45.0f, 640.0f / 480.0f, 0.01f, 1000.0f) * glm::lookAt(camera, camera + dir, glm::vec3(0, 1, 0));
+
+	w->stream(camera);
+	for(int i = 0; i < n; i++)
+		w->generate(all[i], 0);
+	while(generating)
+		jobqueue.finish(1 << 30);
+	w->lightcolumns(n);
+	while(lighting)
+		jobqueue.finish(1 << 30);
+
+	for(int i = 0; i < n; i++) {
+		benchchunk *ch = all[i];
+		if(ch) {
+			glm::vec3 center(ch->ax * CX + CX / 2, ch->ay * CY + CY / 2, ch->az * CZ + CZ / 2);
+			ch->lod = w->lodlevel(glm::length(center - camera), 0);
+		}
+	}
+
+	printf("Comparing one buffer per chunk against a single buffer for all chunks, with the world seen from the starting position:\n");
+
+	bool was_arena_mode = arena_mode;
+
+	for(int mode = 0; mode < 2; mode++) {
+		if(mode && !vertexarena::supported()) {
+			printf("%-17s not supported\n", "single buffer:");
+			break;
+		}
+
+		// Upload all meshes again, into the buffers of this mode
+		arena_mode = mode;
+		for(int i = 0; i < n; i++) {
+			benchchunk *ch = all[i];
+			if(!ch)
+				continue;
+
+			meshjob<CX, CY, CZ> j(ch);
+			j.run();
+			ch->changed = false;
+			ch->stale = 0;
+			ch->initialized = true;
+			j.finish();
+		}
+
+		const int frames = 100;
+		int drawn = 0;
+		double tissue = 0;
+		glViewport(0, 0, 640, 480);
+		glFinish();
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for(int i = 0; i < frames; i++) {
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			std::chrono::steady_clock::time_point issue = std::chrono::steady_clock::now();
+			w->render(pv, camera);
+			tissue += seconds_since(issue);
+			drawn = w->drawn;
+		}
+		glFinish();
+		double trender = seconds_since(start);
+
+		printf("%-17s %5d chunks drawn, issuing draw calls %6.3f ms/frame, until done %6.2f ms/frame\n",
+			mode ? "single buffer:" : "buffer per chunk:", drawn, tissue * 1e3 / frames, trender * 1e3 / frames);
+	}
+
+	arena_mode = was_arena_mode;
+
+	// Rendering may have queued jobs for these chunks after all
+	jobqueue.drain();
+
+	delete w;
+}
+
 int main(int argc, char* argv[]) {
+	bool bench_chunks = false;
+	bool bench_buffers = false;
+
+	for(int i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "--glm-noise")) {
+			simd_noise = false;
+		} else if(!strcmp(argv[i], "--bench-noise")) {
+			bench_noise();
+			return 0;
+		} else if(!strcmp(argv[i], "--bench-raycast")) {
+			bench_raycast();
+			return 0;
+		} else if(!strcmp(argv[i], "--verify-mesher")) {
+			return verify_mesher() ? 0 : 1;
+		} else if(!strcmp(argv[i], "--bench-chunks")) {
+			bench_chunks = true;
+		} else if(!strcmp(argv[i], "--bench-arena")) {
+			bench_buffers = true;
+		}
+	}
+
 	glutInit(&argc, argv);
 	glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GLUT_DOUBLE);
 	glutInitWindowSize(640, 480);
@@ -1120,15 +5564,92 @@ int main(int argc, char* argv[]) {
 		return 1;
 	}
 
+	// The same seed always produces the same world
+	seed = time(NULL);
+	bool seeded = false;
+	for(int i = 1; i < argc - 1; i++) {
+		if(!strcmp(argv[i], "--seed")) {
+			seed = atoi(argv[i + 1]);
+			seeded = true;
+		} else if(!strcmp(argv[i], "--radius")) {
+			view_radius = atoi(argv[i + 1]);
+		} else if(!strcmp(argv[i], "--lod")) {
+			lod_distance = std::max(1, atoi(argv[i + 1]));
+		} else if(!strcmp(argv[i], "--world")) {
+			worlddir = *argv[i + 1] ? argv[i + 1] : 0;
+		}
+	}
+
+	if(worlddir && mkdir(worlddir, 0755) && errno != EEXIST) {
+		fprintf(stderr, "Cannot create %s: %s, the world will not be saved\n", worlddir, strerror(errno));
+		worlddir = 0;
+	}
+
+	// Unless another seed is given, continue with the world that was saved last time
+	if(worlddir) {
+		char path[1024];
+		snprintf(path, sizeof path, "%s/seed", worlddir);
+
+		FILE *f = seeded ? 0 : fopen(path, "r");
+		if(f) {
+			if(fscanf(f, "%d", &seed) != 1)
+				fprintf(stderr, "Cannot read the seed from %s\n", path);
+			fclose(f);
+		} else if((f = fopen(path, "w"))) {
+			fprintf(f, "%d\n", seed);
+			fclose(f);
+		}
+	}
+
+	// Unless another radius is given, keep chunks up to a quarter past the start of the coarsest level of detail.
+	// The chunks within the radius have to fit in the grid around the camera.
+	if(!view_radius)
+		view_radius = (lod_distance << (LODLEVELS - 1)) * 5 / 4 / CX;
+	view_radius = std::max(1, std::min(view_radius, std::min(SCX, SCZ) / 2 - 1));
+
+	printf("Generating world with seed %d, use --seed to get the same world again.\n", seed);
+	printf("Using %s noise for terrain generation, use --glm-noise or --bench-noise to compare.\n", simd_noise ? "batched" : "glm");
+	if(worlddir)
+		printf("Saving the world in %s.\n", worlddir);
+	else
+		printf("Not saving the world, use --world to save it in a directory.\n");
+	printf("Keeping chunks within %d chunks (%d blocks) of the camera, use --radius to change this.\n", view_radius, view_radius * CX);
+	printf("Meshing chunks further than %d blocks away with less detail, use --lod to change this.\n", lod_distance);
+	printf("Use --bench-chunks to compare the speed of different chunk sizes.\n");
+	printf("Use --bench-arena to compare drawing from one buffer per chunk against a single buffer for all chunks.\n");
+	printf("Use --bench-raycast to compare ray casting through the grid of blocks against fixed steps.\n");
+	printf("Use --verify-mesher to check the bitmask face visibility against testing every block.\n");
 	printf("Use the mouse to look around.\n");
 	printf("Use cursor keys, pageup and pagedown to move around.\n");
 	printf("Use home and end to go to two predetermined positions.\n");
 	printf("Press the left mouse button to build a block.\n");
 	printf("Press the right mouse button to remove a block.\n");
+	printf("Press the middle mouse button to blow away a sphere of blocks.\n");
 	printf("Use the scrollwheel to select different types of blocks.\n");
 	printf("Press F1 to toggle between depth buffer and ray casting methods for cube selection.\n");
+	printf("Press F2 to toggle between greedy meshing and merging faces along one axis.\n");
+	printf("Press F3 to toggle between bitmask and per block face visibility in the mesher.\n");
+	printf("Press F4 to toggle between one buffer per chunk and a single buffer for all chunks.\n");
+	printf("Press F5 to toggle occlusion culling.\n");
+	printf("Press F6 to toggle between indexed quads and separate triangles.\n");
+	printf("Press F7 to toggle between compact and plain vertices.\n");
+	printf("Press F8 to toggle meshing distant chunks with less detail.\n");
+	printf("Press F9 to toggle drawing the far away terrain.\n");
+	printf("Press F12 to print statistics.\n");
 
 	if (init_resources()) {
+		if(bench_chunks) {
+			bench_chunksizes();
+			free_resources();
+			return 0;
+		}
+
+		if(bench_buffers) {
+			bench_arena();
+			free_resources();
+			return 0;
+		}
+
 		glutSetCursor(GLUT_CURSOR_NONE);
 		glutWarpPointer(320, 240);
 		glutDisplayFunc(display);
@@ -1140,6 +5661,10 @@ int main(int argc, char* argv[]) {
 		glutPassiveMotionFunc(motion);
 		glutMotionFunc(motion);
 		glutMouseFunc(mouse);
+#ifdef FREEGLUT
+		// Return from the main loop when the window is closed, so the chunks that are still loaded get saved
+		glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS);
+#endif
 		glutMainLoop();
 	}
 
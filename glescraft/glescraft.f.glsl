@@ -1,31 +1,30 @@
-varying vec4 texcoord;
+varying vec3 texcoord;
+varying float shade;
+varying vec2 fromhole;
 uniform sampler2D texture;
+uniform float cutoff;
+uniform float holeradius;
 
 const vec4 fogcolor = vec4(0.6, 0.8, 1.0, 1.0);
-const float fogdensity = .00003;
+const float fogdensity = .00001;
 
 void main(void) {
-	vec2 coord2d;
-	float intensity;
-
-	// If the texture index is negative, it is a top or bottom face, otherwise a side face
-	// Side faces are less bright than top faces, simulating a sun at noon
-	if(texcoord.w < 0.0) {
-		coord2d = vec2((fract(texcoord.x) + texcoord.w) / 16.0, texcoord.z);
-		intensity = 1.0;
-	} else {
-		coord2d = vec2((fract(texcoord.x + texcoord.z) + texcoord.w) / 16.0, -texcoord.y);
-		intensity = 0.85;
-	}
-	
+	// The horizon is not drawn where the chunks are loaded, so it cannot show through or above them
+	if(length(fromhole) < holeradius)
+		discard;
+
+	// The texture coordinates are the position across and along the face, and the texture index
+	vec2 coord2d = vec2((fract(texcoord.x) + texcoord.z) / 16.0, texcoord.y);
+
 	vec4 color = texture2D(texture, coord2d);
 
-	// Very cheap "transparency": don't draw pixels with a low alpha value
-	if(color.a < 0.4)
+	// Don't draw pixels with a low alpha value. Opaque geometry has a high cutoff, so the holes in
+	// leaves stay open, water and glass are blended afterwards and only skip what is nearly invisible.
+	if(color.a < cutoff)
 		discard;
 
-	// Attenuate sides of blocks
-	color.xyz *= intensity;
+	// Attenuate sides of blocks, and corners with ambient occlusion
+	color.xyz *= shade;
 
 	// Calculate strength of fog
 	float z = gl_FragCoord.z / gl_FragCoord.w;
@@ -1,11 +1,61 @@
 attribute vec4 coord;
+attribute vec4 offset;
 uniform mat4 mvp;
-varying vec4 texcoord;
+uniform bool compact;
+uniform bool meshed;
+uniform vec2 holecenter;
+varying vec3 texcoord;
+varying float shade;
+varying vec2 fromhole;
 
 void main(void) {
-	// Just pass the original vertex coordinates to the fragment shader as texture coordinates
-	texcoord = coord;
+	vec4 c = coord;
+	shade = 1.0;
 
-	// Apply the model-view-projection matrix to the xyz components of the vertex coordinates
-	gl_Position = mvp * vec4(coord.xyz, 1);
+	// Chunk and horizon vertices have the ambient occlusion of this corner in the top two bits of x.
+	// The float vertices of the cursor can be anywhere, and are used as they are.
+	if(meshed) {
+		float x = c.x < 0.0 ? c.x + 256.0 : c.x;
+		float ao = floor(x / 64.0);
+		c.x = x - ao * 64.0;
+		shade = 1.0 - ao * 0.2;
+	}
+
+	// Compact vertices are unsigned bytes, with the face in the top two bits of y and z
+	float face = 0.0;
+	if(compact) {
+		vec2 f = floor(c.yz / 64.0);
+		face = f.x + f.y * 4.0;
+		c.yz -= f * 64.0;
+	}
+
+	// The fourth component of chunk and horizon vertices has the light level in bits 4 to 6. Top and bottom
+	// faces of plain vertices have texture indices of 128 and up, which are negative here.
+	if(meshed) {
+		float w = c.w < 0.0 ? c.w + 256.0 : c.w;
+		float light = floor(mod(w, 128.0) / 16.0);
+		w -= light * 16.0;
+		c.w = w >= 128.0 ? w - 256.0 : w;
+		shade *= pow(0.8, 7.0 - light);
+	}
+
+	// Top and bottom faces are textured in the xz plane. Side faces lie in a plane of constant x or z, and take
+	// the other one across and y downwards. Compact vertices know which way their face is looking, for plain ones
+	// top and bottom faces have a negative texture index and the x and z of side faces are simply added.
+	// Side faces are less bright than top faces, simulating a sun at noon.
+	bool flat = compact ? face == 2.0 || face == 3.0 : c.w < 0.0;
+	if(flat) {
+		texcoord = vec3(c.x, c.z, c.w);
+	} else {
+		float across = compact ? (face < 2.0 ? c.z : c.x) : c.x + c.z;
+		texcoord = vec3(across, -c.y, c.w);
+		shade *= 0.85;
+	}
+
+	// Where the vertex is seen from above, relative to the middle of the hole the horizon leaves for the chunks
+	fromhole = c.xz + offset.xz - holecenter;
+
+	// Apply the model-view-projection matrix to the xyz components of the vertex coordinates,
+	// after moving them to the position of their chunk if they come from the shared vertex arena
+	gl_Position = mvp * vec4(c.xyz + offset.xyz, 1);
 }